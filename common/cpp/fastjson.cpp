@@ -0,0 +1,159 @@
+#include "fastjson.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+bool FastJSON::expect(char c) {
+    ws();
+    if (p >= end || *p != c) return false;
+    p++;
+    return true;
+}
+
+bool FastJSON::raw_string(const char *& s, size_t & n) {
+    if (!expect('"')) return false;
+    s = p;
+    while (p < end && *p != '"') {
+	// escapes are left to the full parser
+	if (*p == '\\') return false;
+	p++;
+    }
+    if (p >= end) return false;
+    n = p - s;
+    p++;
+    return true;
+}
+
+bool FastJSON::begin() {
+    first = true;
+    return expect('{');
+}
+
+int FastJSON::next(const char *& key, size_t & n) {
+    ws();
+    if (p < end && *p == '}') {
+	p++;
+	return 0;
+    }
+    if (!first && !expect(',')) return -1;
+    first = false;
+    if (!raw_string(key, n) || !expect(':')) return -1;
+    return 1;
+}
+
+FastJSON::type FastJSON::peek() {
+    ws();
+    if (p >= end) return T_BAD;
+    switch (*p) {
+    case '"': return T_STRING;
+    case '[': return T_ARRAY;
+    case '{': return T_OBJECT;
+    case 't': case 'f': return T_BOOL;
+    case 'n': return T_NULL;
+    case '-': return T_NUMBER;
+    }
+    return (*p >= '0' && *p <= '9') ? T_NUMBER : T_BAD;
+}
+
+bool FastJSON::string(const char *& s, size_t & n) {
+    return raw_string(s, n);
+}
+
+static inline bool digit(const char * q, const char * end) {
+    return q < end && *q >= '0' && *q <= '9';
+}
+
+// the end of the json number at q, or NULL if there is none. strtod takes
+// more than json does, like hex, inf and nan.
+static const char * number_end(const char * q, const char * end) {
+    if (q < end && *q == '-') q++;
+    if (!digit(q, end)) return NULL;
+    if (*q++ != '0') {
+	while (digit(q, end)) q++;
+    }
+    if (q < end && *q == '.') {
+	if (!digit(++q, end)) return NULL;
+	while (digit(q, end)) q++;
+    }
+    if (q < end && (*q == 'e' || *q == 'E')) {
+	q++;
+	if (q < end && (*q == '+' || *q == '-')) q++;
+	if (!digit(q, end)) return NULL;
+	while (digit(q, end)) q++;
+    }
+    return q;
+}
+
+// numbers out of range are left to the full parser as well
+bool FastJSON::number(double & d) {
+    const char * n;
+    char * e;
+    if (peek() != T_NUMBER || !(n = number_end(p, end))) return false;
+    // the closing brace guarantees that strtod stops inside the message
+    d = strtod(p, &e);
+    if (e != n || !isfinite(d)) return false;
+    p = e;
+    return true;
+}
+
+bool FastJSON::number(float & f) {
+    double d;
+    if (!number(d)) return false;
+    f = (float)d;
+    return isfinite(f);
+}
+
+bool FastJSON::boolean(bool & b) {
+    ws();
+    if (end - p >= 4 && !memcmp(p, "true", 4)) {
+	b = true;
+	p += 4;
+	return true;
+    }
+    if (end - p >= 5 && !memcmp(p, "false", 5)) {
+	b = false;
+	p += 5;
+	return true;
+    }
+    return false;
+}
+
+bool FastJSON::numbers(float * v, unsigned int max, unsigned int & n) {
+    n = 0;
+    if (!expect('[')) return false;
+    ws();
+    if (p < end && *p == ']') {
+	p++;
+	return true;
+    }
+    do {
+	if (n == max || !number(v[n++])) return false;
+    } while (expect(','));
+    return expect(']');
+}
+
+bool FastJSON::strings(const char ** s, size_t * n, unsigned int max,
+		       unsigned int & count) {
+    count = 0;
+    if (!expect('[')) return false;
+    ws();
+    if (p < end && *p == ']') {
+	p++;
+	return true;
+    }
+    do {
+	if (count == max || !raw_string(s[count], n[count])) return false;
+	count++;
+    } while (expect(','));
+    return expect(']');
+}
+
+// nothing but whitespace after the object
+bool FastJSON::done() {
+    ws();
+    return p == end;
+}
+
+bool FastJSON::is(const char * s, size_t n, const char * lit) {
+    return strlen(lit) == n && !memcmp(s, lit, n);
+}
@@ -0,0 +1,44 @@
+#ifndef FASTJSON_H
+#define FASTJSON_H
+#include <stddef.h>
+
+/*
+ * A minimal pull parser for flat json objects, for messages which arrive
+ * at high rates. It never allocates and only understands strings without
+ * escapes, numbers, booleans and arrays of those. Everything else makes
+ * it fail, so that the caller can fall back to a full parser.
+ */
+class FastJSON {
+    const char * p;
+    const char * end;
+    bool first;
+
+    void ws() {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+	    p++;
+    }
+    bool expect(char c);
+    bool raw_string(const char *& s, size_t & n);
+public:
+    enum type { T_STRING, T_NUMBER, T_BOOL, T_NULL, T_ARRAY, T_OBJECT, T_BAD };
+
+    FastJSON(const char * s, size_t n) : p(s), end(s + n), first(true) {}
+
+    bool begin();
+    // 1 and the next key, 0 at the end of the object, -1 on errors
+    int next(const char *& key, size_t & n);
+    type peek();
+
+    bool string(const char *& s, size_t & n);
+    bool number(double & d);
+    bool number(float & f);
+    bool boolean(bool & b);
+    bool numbers(float * v, unsigned int max, unsigned int & n);
+    bool strings(const char ** s, size_t * n, unsigned int max,
+		 unsigned int & count);
+    bool done();
+
+    static bool is(const char * s, size_t n, const char * lit);
+};
+
+#endif
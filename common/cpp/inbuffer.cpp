@@ -0,0 +1,63 @@
+#include "inbuffer.h"
+#include <stdlib.h>
+#include <string.h>
+
+// reads which find the buffer empty before it shrinks back to min
+const unsigned int TRIM_AFTER = 16;
+
+InBuffer::InBuffer(size_t _min, size_t _max)
+: buf(NULL), cap(0), head(0), tail(0), min(_min), max(_max), idle(0) {
+    if (max < min) max = min;
+}
+
+InBuffer::~InBuffer() {
+    free(buf);
+}
+
+char * InBuffer::reserve(size_t n) {
+    size_t len = size();
+    size_t ncap;
+    char * nbuf;
+
+    if (len + n > max) return NULL;
+    if (tail + n <= cap) return buf + tail;
+
+    if (head) {
+	memmove(buf, buf + head, len);
+	head = 0;
+	tail = len;
+	if (tail + n <= cap) return buf + tail;
+    }
+
+    ncap = cap ? cap : min;
+    while (ncap < len + n) ncap *= 2;
+    if (ncap > max) ncap = max;
+
+    nbuf = (char*)realloc(buf, ncap);
+    if (!nbuf) throw("out of memory");
+    buf = nbuf;
+    cap = ncap;
+    idle = 0;
+    return buf + tail;
+}
+
+void InBuffer::consume(size_t n) {
+    head += n;
+    if (head >= tail) head = tail = 0;
+}
+
+void InBuffer::limit(size_t _max) {
+    max = _max < min ? min : _max;
+}
+
+void InBuffer::trim() {
+    if (size() || cap <= min) return;
+    if (++idle < TRIM_AFTER) return;
+
+    char * nbuf = (char*)realloc(buf, min);
+    if (nbuf) {
+	buf = nbuf;
+	cap = min;
+    }
+    idle = 0;
+}
@@ -0,0 +1,38 @@
+#ifndef INBUFFER_H
+#define INBUFFER_H
+#include <stddef.h>
+
+/*
+ * Input bytes waiting to be split into messages. Consumed messages are
+ * dropped from the front and the rest of a partial message is moved back
+ * to the start when room is needed, so messages stay contiguous for the
+ * parsers. The buffer doubles when a message does not fit, never grows
+ * past max, and shrinks back to min once it has been empty for a while.
+ */
+class InBuffer {
+    char * buf;
+    size_t cap, head, tail;
+    size_t min, max;
+    unsigned int idle;
+
+public:
+    InBuffer(size_t _min, size_t _max);
+    ~InBuffer();
+
+    char * data() { return buf + head; }
+    size_t size() const { return tail - head; }
+    size_t capacity() const { return cap; }
+    // bytes that can still be added before reaching max
+    size_t room() const { return max - size(); }
+
+    // space for n more bytes, NULL if that would pass max
+    char * reserve(size_t n);
+    void commit(size_t n) { tail += n; }
+    void consume(size_t n);
+    void clear() { head = tail = 0; }
+    void limit(size_t _max);
+    // give back memory after a spike, once the buffer is empty
+    void trim();
+};
+
+#endif
@@ -4,9 +4,66 @@
 #include <string>
 #include <string.h>
 #include <fstream>
+#include <errno.h>
+#include <unistd.h>
 
-// lets be a little conservative here
-const size_t INBUF_BLOCKSIZE = 1024;
+// most bytes taken from the stream at once
+const size_t READ_CHUNK = 16384;
+
+std::list<Interpol*> Interpol::clients;
+unsigned int Interpol::all_events = 0;
+Interpol * Interpol::current = NULL;
+
+// makes a client current while its message is handled
+struct CurrentClient {
+    Interpol * prev;
+    CurrentClient(Interpol * c) : prev(Interpol::current) {
+	Interpol::current = c;
+    }
+    ~CurrentClient() {
+	Interpol::current = prev;
+    }
+};
+
+// makes the rid of a message the one replies go out with, and acks the
+// message when it was handled without any other reply. requests nest
+// when a command evaluates a script.
+struct Request {
+    Interpol * c;
+    std::string prev;
+    bool prev_replied;
+
+    Request(Interpol * _c, Json::Value & root)
+    : c(_c), prev_replied(_c->replied) {
+	prev.swap(c->rid);
+	c->replied = false;
+	if (root.isObject() && root.isMember("rid")) {
+	    static Json::FastWriter w;
+	    Json::Value & v = root["rid"];
+	    if (v.isString() || v.isNumeric()) {
+		c->rid = w.write(v);
+		// FastWriter appends a newline
+		c->rid.resize(c->rid.size() - 1);
+	    }
+	}
+    }
+    ~Request() {
+	if (!c->rid.empty() && !c->replied) c->send_ack();
+	prev.swap(c->rid);
+	c->replied = prev_replied;
+    }
+};
+
+Interpol::~Interpol() {
+    if (events) unsubscribe(events);
+    if (current == this) current = NULL;
+}
+
+void Interpol::limit(size_t max) {
+    max_message = max;
+    // room for the terminator after the message
+    inbuf.limit(max + 1);
+}
 
 void Interpol::Err(int code, const char * s) {
     if (err) {
@@ -32,23 +89,34 @@ void Interpol::eval(const char * file) {
 }
 
 void Interpol::eval(std::istream & script) {
-    Interpol tcomm = Interpol(name, cb, script, out);
+    Interpol tcomm(name, cb, script, out);
     tcomm.seperator = '\n';
+    tcomm.oq = oq;
+    tcomm.sink = sink;
+    tcomm.sink_arg = sink_arg;
+    tcomm.fast = fast;
+    tcomm.parent = this;
+    tcomm.limit(max_message);
     tcomm.read();
 }
 
-void Interpol::handle_message(size_t pos, size_t end) {
+void Interpol::handle_message(const char * s, size_t n) {
+    CurrentClient c(client());
+
+    if (fast && fast(s, n)) return;
+    handle_json(s, n);
+}
+
+void Interpol::handle_json(const char * s, size_t n) {
     Json::Reader r;
     Json::Value root;
 
 /*
-    std::cerr << "handle_message(" << pos << ", " << end << ")" << std::endl;
-    std::cerr << "parsing " << end-pos << " bytes from "
-	      << (void*)inbuf << std::endl;
-    std::cerr << "parsing '" << std::string(inbuf+pos, end-pos) << std::endl;
+    std::cerr << "parsing " << n << " bytes from " << (void*)s << std::endl;
+    std::cerr << "parsing '" << std::string(s, n) << std::endl;
 */
 
-    if (!r.parse(inbuf+pos, inbuf+end, root, false)) {
+    if (!r.parse(s, s+n, root, false)) {
 	std::cerr << "Parsing error:\n" << r.getFormatedErrorMessages() << std::endl;
 	send_error("bad json");
 	return;
@@ -60,91 +128,239 @@ void Interpol::handle_message(size_t pos, size_t end) {
 	return;
     }
 
+    Request req(client(), root);
+
     try {
-	if (root.isMember("cmd")) {
+	if (root.isMember("cmd") && root["cmd"].isString()) {
 	    EXPECT_MAP::iterator item;
-	    const char * cmd = root["cmd"].asCString();
-	    item = expected.find(cmd);
+	    item = expected.find(root["cmd"].asString());
 	    if (item != expected.end()) {
+		InterpolCallback f = item->second;
+		expected.erase(item);
 		try {
-		    item->second(root);
+		    f(root);
 		} catch (...) {
 		    std::cerr << "exception in call to expected callback"
 			      << std::endl;
 		}
-		expected.erase(item);
 		return;
 	    }
 	}
 	cb(root);
     } catch (...) {
-	send_error("generic");
+	client()->send_error("generic");
     }
 }
 
-void Interpol::read() {
-    std::string s;
+/*
+ * Handles all complete messages in inbuf. Each one is terminated in place
+ * for the parsers, which may rely on that.
+ */
+void Interpol::split_messages() {
+    char * p, * sep;
+    size_t len;
 
-    /*
-     * This is a bit not quite enough. getline might still block
-     * in case we have an incomplete json packet waiting
-     */
-    do {
-	if (inbuf_capacity - inbuf_size < INBUF_BLOCKSIZE) {
-	    inbuf = (char*)realloc(inbuf, inbuf_capacity + INBUF_BLOCKSIZE);
-	    if (!inbuf) {
-		Err(1, "OUT OF MEMORY");
+    while (inbuf.size() > scanned) {
+	p = inbuf.data();
+	sep = (char*)memchr(p + scanned, seperator, inbuf.size() - scanned);
+	if (!sep) break;
+	len = sep - p;
+	*sep = '\0';
+	if (discarding) {
+	    discarding = false;
+	} else if (len) {
+	    try {
+		handle_message(p, len);
+	    } catch (...) {
+		std::cerr << "some unknown error in handle_message" << std::endl;
+		send_error("generic");
 	    }
-	    inbuf_capacity += INBUF_BLOCKSIZE;
 	}
+	inbuf.consume(len + 1);
+	scanned = 0;
+    }
+    scanned = inbuf.size();
 
-	in.getline(inbuf+inbuf_size, inbuf_capacity - inbuf_size, seperator);
-	inbuf_size += in.gcount();
+    if (scanned > max_message && !discarding) {
+	std::cerr << "message longer than " << max_message
+		  << " bytes, skipping it" << std::endl;
+	client()->send_error("message too large");
+	discarding = true;
+    }
+    if (discarding) {
+	inbuf.clear();
+	scanned = 0;
+    }
+}
 
-	if (!in.gcount()) Err(0, "FOO");
+// the last message may lack its seperator
+void Interpol::end_of_input() {
+    if (inbuf.size() && !discarding) {
+	char * w = inbuf.reserve(1);
+	*w = seperator;
+	inbuf.commit(1);
+	split_messages();
+    }
+    inbuf.clear();
+    scanned = 0;
+    discarding = false;
+    in.setstate(std::ios::eofbit);
+    Err(0, "end of file");
+}
 
-	if (in.bad()) goto bad;
-	if (in.fail()) {
-	    in.clear();
-	    continue;
-	}
+/*
+ * Reads the whole stream, as for scripts. If a message is incomplete we
+ * keep reading, which may block until the rest of it arrives.
+ */
+void Interpol::read() {
+    std::streambuf * sb = in.rdbuf();
+    std::streamsize n;
+    char * w;
 
-	// subtract the seperator
-	if (!in.eof()) inbuf_size--;
+    do {
+	n = sb->in_avail();
+	// nothing buffered, wait for at least one byte
+	if (n <= 0) n = 1;
+	if ((size_t)n > READ_CHUNK) n = READ_CHUNK;
+	if ((size_t)n > inbuf.room()) n = inbuf.room();
 
-	if (inbuf_size) {
-	    try {
-		handle_message(0, inbuf_size);
-	    } catch (...) {
-		std::cerr << "some unknown error in handle_message" << std::endl;
-		send_error("generic");
-	    }
+	w = inbuf.reserve(n);
+	n = sb->sgetn(w, n);
+	if (n <= 0) {
+	    end_of_input();
+	    break;
 	}
+	inbuf.commit(n);
+	split_messages();
+    } while (sb->in_avail() > 0 || inbuf.size() || discarding);
+
+    inbuf.trim();
+}
 
-	if (in.eof()) {
-	    // end of file. shutdown
-bad:
+/*
+ * Takes one read of what is readable on fd and handles the messages which
+ * are complete. The rest of a message, or of one being skipped, waits in
+ * inbuf until fd is readable again, so the event loop never blocks here.
+ */
+void Interpol::read(int fd) {
+    size_t n = READ_CHUNK;
+    ssize_t got;
+    char * w;
 
-	    Err(0, "end of file");
-	} else if (!inbuf_size) break;
-	inbuf_size = 0;
-    } while (in.rdbuf()->in_avail());
+    if (n > inbuf.room()) n = inbuf.room();
+    w = inbuf.reserve(n);
+    got = ::read(fd, w, n);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	return;
+    if (got <= 0) {
+	end_of_input();
+	return;
+    }
+    inbuf.commit(got);
+    split_messages();
+    inbuf.trim();
 }
 
 void Interpol::expect_command(const char * cmd, InterpolCallback cb) {
-    expected.insert(std::pair<const char *, InterpolCallback>(cmd, cb));
+    expected[cmd] = cb;
 }
 
 /* 
  * message handling
  */
-void Interpol::send_error(const char * s, size_t n) {
-    JSONBuilder buf;
-    buf.add(s, n);
-    (out << "{  \"src\" : \"" << name << "\", \"cmd\" : \"error\", \"error\" : " << buf.buf << " }").put(seperator);
+void Interpol::send(const char * s, size_t n, OutQueue::priority p,
+		    const char * key) {
+    if (sink) {
+	sink(sink_arg, s, n, p);
+    } else if (oq) {
+	oq->push(s, n, p, key);
+    } else {
+	out.write(s, n);
+	out.flush();
+    }
+}
+
+void Interpol::send_message(const std::string & s, OutQueue::priority p,
+			    const char * key) {
+    msg.buf.assign(s);
+    msg.buf += seperator;
+    send(msg.buf.data(), msg.buf.size(), p, key);
+}
+
+/*
+ * event subscriptions
+ */
+static void update_events() {
+    std::list<Interpol*>::iterator it;
+    Interpol::all_events = 0;
+    for (it = Interpol::clients.begin(); it != Interpol::clients.end(); it++)
+	Interpol::all_events |= (*it)->events;
+}
+
+void Interpol::subscribe(unsigned int mask) {
+    if (!events) clients.push_back(this);
+    events |= mask;
+    update_events();
+}
+
+void Interpol::unsubscribe(unsigned int mask) {
+    if (!events) return;
+    events &= ~mask;
+    if (!events) {
+	clients.remove(this);
+	event_ids.clear();
+    }
+    update_events();
+}
+
+// events are low priority, a slow client rather misses some than stalls
+void Interpol::broadcast(unsigned int event, const std::string & id,
+			 const std::string & message) {
+    std::list<Interpol*>::iterator it;
+    for (it = clients.begin(); it != clients.end(); it++) {
+	Interpol * c = *it;
+	if (!(c->events & event)) continue;
+	if (c->event_ids.size() && !c->event_ids.count(id)) continue;
+	c->send_message(message, OutQueue::LOW);
+    }
+}
+
+void Interpol::flush() {
+    if (oq) oq->flush_sync(1000);
     out.flush();
 }
 
+void Interpol::begin_message(const char * cmd) {
+    msg.clear();
+    msg.object();
+    msg.key("src");
+    msg.add(name);
+    msg.key("cmd");
+    msg.add(cmd);
+}
+
+// a reply to the current request answers it, no ack is sent after it
+void Interpol::add_rid(JSONBuilder & b) {
+    if (rid.empty()) return;
+    b.key("rid");
+    b.raw(rid);
+    replied = true;
+}
+
+void Interpol::end_message() {
+    msg.end();
+    msg.buf += seperator;
+    send(msg.buf.data(), msg.buf.size());
+}
+
+void Interpol::send_error(const char * s, size_t n) {
+    begin_message("error");
+    add_rid(msg);
+    msg.key("error");
+    msg.add(s, n);
+    end_message();
+}
+
 void Interpol::send_error(const char * s) {
     send_error(s, strlen(s));
 }
@@ -154,16 +370,35 @@ void Interpol::send_error(std::string & s) {
 }
 
 void Interpol::send_error(int c) {
-    (out << "{  \"src\" : \"" << name << "\", \"cmd\" : \"error\", \"error\" : " << c << " }").put(seperator);
-    out.flush();
+    begin_message("error");
+    add_rid(msg);
+    msg.key("error");
+    msg.add(c);
+    end_message();
 }
 
 void Interpol::send_command(const char * s) {
-    (out << "{  \"src\" : \"" << name << "\", \"cmd\" : \"" << s << "\" }").put(seperator);
-    out.flush();
+    begin_message(s);
+    end_message();
 }
 
 void Interpol::send_data(std::string & s) {
-    (out << "{ \"src\" : \"" << name << "\", \"cmd\" : \"data\", \"data\" : " << s << " }").put(seperator);
-    out.flush();
+    begin_message("data");
+    msg.key("data");
+    msg.raw(s);
+    end_message();
+}
+
+void Interpol::send_ack() {
+    begin_message("ack");
+    add_rid(msg);
+    end_message();
+}
+
+// sends a message built by the application, which must still be open
+void Interpol::send_reply(JSONBuilder & b) {
+    add_rid(b);
+    b.end();
+    b.buf += seperator;
+    send(b.buf.data(), b.buf.size());
 }
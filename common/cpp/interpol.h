@@ -2,56 +2,135 @@
 #define INTERPOL_H
 
 #include "json_builder.h"
+#include "outqueue.h"
+#include "inbuffer.h"
 #include <iostream>
+#include <list>
+#include <set>
 #include <json/value.h>
 #include <json/reader.h>
 #include <json/writer.h>
 
 typedef void (*InterpolCallback)(Json::Value&);
 typedef void (*InterpolErrorCallback)(int, const char*);
-typedef std::map<const char *, InterpolCallback> EXPECT_MAP;
+// returns true if it handled the raw message, false to parse it as json
+typedef bool (*InterpolFastCallback)(const char*, size_t);
+// takes the messages of a client which is neither a stream nor an OutQueue
+typedef void (*InterpolSink)(void *, const char *, size_t,
+			     OutQueue::priority);
+typedef std::map<std::string, InterpolCallback> EXPECT_MAP;
 
 class Interpol {
+public:
+    static const size_t INBUF_MIN = 4096;
+    static const size_t DEFAULT_MAX_MESSAGE = 1 << 20;
+
+private:
     std::istream & in;
     std::ostream & out;
-    size_t inbuf_size, inbuf_capacity;
-    char * inbuf;
+    InBuffer inbuf;
+    // bytes of inbuf already searched for the seperator
+    size_t scanned;
+    size_t max_message;
+    // the rest of an oversize message is skipped
+    bool discarding;
     InterpolCallback cb;
     EXPECT_MAP expected;
+    JSONBuilder msg;
+    // scripts run on behalf of the client which evaluated them
+    Interpol * parent;
 
     void Err(int, const char *);
-    void handle_message(size_t, size_t);
+    void handle_message(const char *, size_t);
+    void handle_json(const char *, size_t);
+    void split_messages();
+    void end_of_input();
+    void begin_message(const char * cmd);
+    void end_message();
+    void add_rid(JSONBuilder &);
 
 public:
     void read();
+    void read(int fd);
+    // a message which arrived some other way. s[n] must be readable and
+    // must not continue a number, as in a terminated string
+    void handle(const char * s, size_t n) {
+	handle_message(s, n);
+    }
     InterpolErrorCallback err;
+    InterpolFastCallback fast;
     const char * name;
     char seperator;
+    // if set, messages are queued here instead of written to out
+    OutQueue * oq;
+    // if set, messages are handed to it instead
+    InterpolSink sink;
+    void * sink_arg;
+    // event bits this client subscribed to, optionally only for some ids
+    unsigned int events;
+    std::set<std::string> event_ids;
+
+    // clients with subscriptions, and the union of their events
+    static std::list<Interpol*> clients;
+    static unsigned int all_events;
+    // the client whose message is being handled
+    static Interpol * current;
+
+    // "rid" of the request being handled, as json text, empty if there
+    // is none. the request is acknowledged unless something replied to it
+    std::string rid;
+    bool replied;
 
     Interpol(const char * _name, InterpolCallback _cb)
-    : in(std::cin), out(std::cout), inbuf_size(0), inbuf_capacity(0),
-      inbuf(NULL), cb(_cb), err(NULL), name(_name), seperator('\0')
+    : in(std::cin), out(std::cout), inbuf(INBUF_MIN, DEFAULT_MAX_MESSAGE + 1),
+      scanned(0), max_message(DEFAULT_MAX_MESSAGE), discarding(false),
+      cb(_cb), parent(NULL), err(NULL), fast(NULL), name(_name),
+      seperator('\0'), oq(NULL), sink(NULL), sink_arg(NULL), events(0),
+      replied(false)
     { }
 
     Interpol(const char * _name, InterpolCallback _cb, std::istream & _in,
 	     std::ostream & _out) 
-    : in(_in), out(_out), inbuf_size(0), inbuf_capacity(0),
-      inbuf(NULL), cb(_cb), err(NULL), name(_name), seperator('\0')
+    : in(_in), out(_out), inbuf(INBUF_MIN, DEFAULT_MAX_MESSAGE + 1),
+      scanned(0), max_message(DEFAULT_MAX_MESSAGE), discarding(false),
+      cb(_cb), parent(NULL), err(NULL), fast(NULL), name(_name),
+      seperator('\0'), oq(NULL), sink(NULL), sink_arg(NULL), events(0),
+      replied(false)
     { }
 
+    ~Interpol();
+
+    // longer messages are answered with an error and skipped
+    void limit(size_t max);
+
     void send_error(const char *, size_t);
     void send_error(const char *);
     void send_error(std::string &);
     void send_error(int);
     void send_command(const char *);
+    void send_ack();
+    void send_reply(JSONBuilder &);
     void send_data(std::string &);
+    void send(const char *, size_t,
+	      OutQueue::priority p = OutQueue::NORMAL, const char * key = NULL);
+    void send_message(const std::string &,
+		      OutQueue::priority p = OutQueue::NORMAL,
+		      const char * key = NULL);
+    void flush();
+    Interpol * client() {
+	return parent ? parent->client() : this;
+    }
+    void subscribe(unsigned int);
+    void unsubscribe(unsigned int);
+    static void broadcast(unsigned int event, const std::string & id,
+			  const std::string & message);
     void expect_command(const char * cmd, InterpolCallback cb);
     void eval(std::istream &);
     void eval(std::string &);
     void eval(const char *);
 
     static void read_cb(int fd, short flags, void *obj) {
-	((Interpol*)obj)->read();
+	((Interpol*)obj)->read(fd);
     }
 };
 #endif
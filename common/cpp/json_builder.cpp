@@ -1,16 +1,28 @@
 #include "json_builder.h"
 #include <cstdio>
+#include <cstdlib>
 #include "string.h"
-#include <boost/lexical_cast.hpp>
+
+static const char hex[] = "0123456789abcdef";
 
 void JSONBuilder::put(std::string & s) { buf.append(s); }
 void JSONBuilder::put(const char * s) { buf.append(s); }
 void JSONBuilder::put(const char * s, size_t n) { buf.append(s, n); }
 
-void JSONBuilder::add(const char * s, size_t size) {
+// a comma if this is not the first value in an object or array
+void JSONBuilder::sep() {
+    if (after_key) {
+	after_key = false;
+	return;
+    }
+    if (!depth) return;
+    if (!first[depth-1]) buf += ',';
+    first[depth-1] = false;
+}
+
+void JSONBuilder::quote(const char * s, size_t size) {
     size_t start = 0;
-    char b[20];
-    buf.append("\"");
+    buf += '"';
     for (size_t i = 0; i < size; i++) {
 	unsigned char c = s[i];
 	if (c <= 0x1f || c == '\\' || c == '"') {
@@ -26,8 +38,9 @@ void JSONBuilder::add(const char * s, size_t size) {
 	    case '\\': buf.append("\\\\"); break;
 	    case '"': buf.append("\\\""); break;
 	    default:
-		std::sprintf(b, "\\u%04u", (unsigned int)c);
-		buf.append(b);
+		buf.append("\\u00");
+		buf += hex[c >> 4];
+		buf += hex[c & 0xf];
 	    }
 
 	    start = i+1;
@@ -37,7 +50,22 @@ void JSONBuilder::add(const char * s, size_t size) {
     if (start < size) {
 	buf.append(s+start, size-start);
     }
-    buf.append("\"");
+    buf += '"';
+}
+
+// an already serialized value
+void JSONBuilder::raw(const char * s, size_t n) {
+    sep();
+    buf.append(s, n);
+}
+
+void JSONBuilder::raw(const std::string & s) {
+    raw(s.data(), s.size());
+}
+
+void JSONBuilder::add(const char * s, size_t size) {
+    sep();
+    quote(s, size);
 }
 
 void JSONBuilder::add(const char * s) {
@@ -45,12 +73,130 @@ void JSONBuilder::add(const char * s) {
 }
 
 void JSONBuilder::add(const std::string & s) {
-    add(s.c_str(), s.size());
+    add(s.data(), s.size());
+}
+
+void JSONBuilder::add(const unsigned long n) {
+    char b[24];
+    char * p = b + sizeof(b);
+    unsigned long v = n;
+
+    sep();
+    do {
+	*--p = '0' + v % 10;
+	v /= 10;
+    } while (v);
+    buf.append(p, b + sizeof(b) - p);
+}
+
+void JSONBuilder::add(const long n) {
+    if (n < 0) {
+	sep();
+	buf += '-';
+	after_key = true;
+	// no overflow for the smallest long
+	add((unsigned long)0 - (unsigned long)n);
+    } else {
+	add((unsigned long)n);
+    }
 }
 
 void JSONBuilder::add(const unsigned int n) {
-    buf += boost::lexical_cast<std::string>(n);
+    add((unsigned long)n);
+}
+
+void JSONBuilder::add(const int n) {
+    add((long)n);
+}
+
+/*
+ * Shortest representation which reads back to the same value. %g drops
+ * trailing zeros, so a value with a short decimal form already comes out
+ * short at the smallest precision that round trips.
+ */
+void JSONBuilder::add(const double d) {
+    char b[32];
+    int n = 0;
+
+    // json has no nan or infinity
+    if (d != d || d - d != 0) {
+	null();
+	return;
+    }
+
+    for (int prec = 15; prec <= 17; prec++) {
+	n = std::snprintf(b, sizeof(b), "%.*g", prec, d);
+	if (strtod(b, NULL) == d) break;
+    }
+    sep();
+    buf.append(b, n);
+}
+
+void JSONBuilder::add(const float f) {
+    char b[32];
+    int n = 0;
+
+    if (f != f || f - f != 0) {
+	null();
+	return;
+    }
+
+    for (int prec = 6; prec <= 9; prec++) {
+	n = std::snprintf(b, sizeof(b), "%.*g", prec, (double)f);
+	if (strtof(b, NULL) == f) break;
+    }
+    sep();
+    buf.append(b, n);
+}
+
+void JSONBuilder::add(const bool b) {
+    sep();
+    buf.append(b ? "true" : "false");
+}
+
+void JSONBuilder::null() {
+    sep();
+    buf.append("null");
+}
+
+void JSONBuilder::open(char c, char close) {
+    if (depth == MAX_DEPTH)
+	throw("json nesting too deep");
+    sep();
+    buf += c;
+    first[depth] = true;
+    closer[depth] = close;
+    depth++;
+}
+
+void JSONBuilder::object() {
+    open('{', '}');
+}
+
+void JSONBuilder::array() {
+    open('[', ']');
+}
+
+void JSONBuilder::end() {
+    after_key = false;
+    if (!depth) return;
+    buf += closer[--depth];
+}
+
+void JSONBuilder::key(const char * k) {
+    sep();
+    quote(k, strlen(k));
+    buf += ':';
+    after_key = true;
+}
+
+// start over, keeping the capacity
+void JSONBuilder::clear() {
+    buf.clear();
+    depth = 0;
+    after_key = false;
 }
 
 void JSONBuilder::reserve(size_t n) {
+    buf.reserve(n);
 }
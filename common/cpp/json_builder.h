@@ -2,19 +2,50 @@
 #define JSON_BUILDER_H
 #include <string>
 
+/*
+ * Streaming json writer. Values are appended to buf, which keeps its
+ * capacity across clear(), so a reused builder does not allocate.
+ * Inside object() and array() commas are inserted automatically;
+ * put() appends raw text.
+ */
 class JSONBuilder {
+    enum { MAX_DEPTH = 32 };
+    unsigned int depth;
+    bool first[MAX_DEPTH];
+    char closer[MAX_DEPTH];
+    bool after_key;
+
+    void sep();
+    void open(char c, char close);
+    void quote(const char * s, size_t size);
 public:
-    JSONBuilder() {}
+    JSONBuilder() : depth(0), after_key(false) {}
     std::string buf;
 
     void put(std::string & s);
     void put(const char * s);
     void put(const char * s, size_t n);
+    void raw(const char * s, size_t n);
+    void raw(const std::string & s);
     void add(const char * s, size_t size);
 
     void add(const char * s);
     void add(const std::string & s);
     void add(const unsigned int n);
+    void add(const int n);
+    void add(const unsigned long n);
+    void add(const long n);
+    void add(const double d);
+    void add(const float f);
+    void add(const bool b);
+    void null();
+
+    void object();
+    void array();
+    void end();
+    void key(const char * k);
+
+    void clear();
     void reserve(size_t n);
 };
 
@@ -0,0 +1,266 @@
+#include "osc.h"
+#include <string.h>
+#include <vector>
+#include <arpa/inet.h>
+
+// seconds from 1900 (ntp) to 1970 (unix)
+const uint32_t NTP_UNIX_OFFSET = 2208988800U;
+const int MAX_BUNDLE_DEPTH = 8;
+// longer address patterns never match
+const size_t MAX_PATTERN = 256;
+
+static inline uint32_t be32(const char * p) {
+    uint32_t w;
+    memcpy(&w, p, 4);
+    return ntohl(w);
+}
+
+// a padded string, returns the position after it or NULL
+static const char * skip_string(const char * p, const char * end) {
+    const char * z = (const char *)memchr(p, '\0', end - p);
+    if (!z) return NULL;
+    p += ((z - p) / 4 + 1) * 4;
+    return p <= end ? p : NULL;
+}
+
+bool OscMessage::parse(const char * s, size_t n) {
+    end = s + n;
+    if (n < 4 || s[0] != '/') return false;
+    address = s;
+    if (!(p = skip_string(s, end))) return false;
+
+    // messages without type tags are allowed, and have no arguments
+    if (p == end || *p != ',') {
+	types = "";
+	return p == end;
+    }
+    types = p + 1;
+    return (p = skip_string(p, end)) != NULL;
+}
+
+bool OscMessage::word(uint32_t & w) {
+    if (end - p < 4) return false;
+    w = be32(p);
+    p += 4;
+    return true;
+}
+
+bool OscMessage::get(double & d) {
+    uint32_t w, w2;
+    switch (*types) {
+    case 'i':
+	if (!word(w)) return false;
+	d = (int32_t)w;
+	break;
+    case 'f': {
+	float f;
+	if (!word(w)) return false;
+	memcpy(&f, &w, 4);
+	d = f;
+	break;
+    }
+    case 'h':
+	if (!word(w) || !word(w2)) return false;
+	d = (double)(int64_t)(((uint64_t)w << 32) | w2);
+	break;
+    case 'd': {
+	uint64_t u;
+	if (!word(w) || !word(w2)) return false;
+	u = ((uint64_t)w << 32) | w2;
+	memcpy(&d, &u, 8);
+	break;
+    }
+    case 'T':
+	d = 1.0;
+	break;
+    case 'F':
+	d = 0.0;
+	break;
+    default:
+	return false;
+    }
+    types++;
+    return true;
+}
+
+bool OscMessage::get(float & f) {
+    double d;
+    if (!get(d)) return false;
+    f = (float)d;
+    return true;
+}
+
+bool OscMessage::get(bool & b) {
+    double d;
+    if (!get(d)) return false;
+    b = d != 0.0;
+    return true;
+}
+
+bool OscMessage::get(const char *& s) {
+    if (*types != 's' && *types != 'S') return false;
+    s = p;
+    if (!(p = skip_string(p, end))) return false;
+    types++;
+    return true;
+}
+
+bool OscMessage::skip() {
+    const char * s;
+    double d;
+    switch (*types) {
+    case 's': case 'S':
+	return get(s);
+    case 'b': {
+	uint32_t n;
+	if (!word(n) || (size_t)(end - p) < n) return false;
+	p += (n + 3) & ~3U;
+	if (p > end) return false;
+	types++;
+	return true;
+    }
+    case 'N': case 'I':
+	types++;
+	return true;
+    case 't': case 'c': case 'r': case 'm':
+	if (end - p < (*types == 't' ? 8 : 4)) return false;
+	p += *types == 't' ? 8 : 4;
+	types++;
+	return true;
+    }
+    return get(d);
+}
+
+bool oscBundleTime(const char * s, size_t n, OscTime & t) {
+    if (n < 16 || memcmp(s, "#bundle", 8)) return false;
+    t = ((uint64_t)be32(s + 8) << 32) | be32(s + 12);
+    return true;
+}
+
+double oscUnixTime(OscTime t) {
+    return (double)((uint32_t)(t >> 32) - NTP_UNIX_OFFSET)
+	   + (double)(uint32_t)t / 4294967296.0;
+}
+
+static bool dispatch(const char * s, size_t n, OscHandler & h, int depth) {
+    OscTime t;
+
+    if (oscBundleTime(s, n, t)) {
+	const char * p = s + 16, * end = s + n;
+	if (depth == MAX_BUNDLE_DEPTH) return false;
+	while (p < end) {
+	    uint32_t len;
+	    if (end - p < 4) return false;
+	    len = be32(p);
+	    p += 4;
+	    if ((size_t)(end - p) < len) return false;
+	    if (!dispatch(p, len, h, depth + 1)) return false;
+	    p += len;
+	}
+	return true;
+    }
+
+    OscMessage m;
+    if (!m.parse(s, n)) return false;
+    h.message(m);
+    return true;
+}
+
+bool oscDispatch(const char * s, size_t n, OscHandler & h) {
+    return dispatch(s, n, h, 0);
+}
+
+// what is left of a pattern and a string, at offsets already known not to
+// match. without them every * and {} tries the rest again, which takes
+// exponential time on patterns like /*a*a*a*a*a*b.
+struct Match {
+    const char * p, * s;
+    size_t pn, sn;
+    std::vector<bool> failed;
+};
+
+static bool match(Match & m, size_t pi, size_t si);
+
+static bool matchFrom(Match & m, size_t pi, size_t si) {
+    const char * p = m.p + pi, * s = m.s + si;
+    size_t pn = m.pn - pi, sn = m.sn - si;
+
+    while (pn) {
+	switch (*p) {
+	case '*':
+	    while (pn && *p == '*') {
+		p++;
+		pn--;
+	    }
+	    for (size_t i = 0; i <= sn; i++) {
+		if (match(m, p - m.p, s + i - m.s)) return true;
+	    }
+	    return false;
+	case '?':
+	    if (!sn) return false;
+	    break;
+	case '[': {
+	    const char * c = p + 1, * close = (const char *)memchr(p, ']', pn);
+	    bool neg = false, hit = false;
+	    if (!close || !sn) return false;
+	    if (c < close && *c == '!') {
+		neg = true;
+		c++;
+	    }
+	    for (; c < close; c++) {
+		if (c + 2 < close && c[1] == '-') {
+		    if (*s >= c[0] && *s <= c[2]) hit = true;
+		    c += 2;
+		} else if (*s == *c) {
+		    hit = true;
+		}
+	    }
+	    if (hit == neg) return false;
+	    pn -= close - p;
+	    p = close;
+	    break;
+	}
+	case '{': {
+	    const char * close = (const char *)memchr(p, '}', pn);
+	    const char * alt = p + 1;
+	    if (!close) return false;
+	    while (alt <= close) {
+		const char * comma = alt;
+		while (comma < close && *comma != ',') comma++;
+		size_t len = comma - alt;
+		if (len <= sn && !memcmp(alt, s, len)
+		    && match(m, close + 1 - m.p, s + len - m.s))
+		    return true;
+		alt = comma + 1;
+	    }
+	    return false;
+	}
+	default:
+	    if (!sn || *p != *s) return false;
+	}
+	p++;
+	pn--;
+	s++;
+	sn--;
+    }
+    return sn == 0;
+}
+
+static bool match(Match & m, size_t pi, size_t si) {
+    size_t k = pi * (m.sn + 1) + si;
+    if (m.failed[k]) return false;
+    if (matchFrom(m, pi, si)) return true;
+    m.failed[k] = true;
+    return false;
+}
+
+bool oscMatch(const char * p, size_t pn, const char * s, size_t sn) {
+    Match m;
+    if (pn > MAX_PATTERN) return false;
+    m.p = p;
+    m.pn = pn;
+    m.s = s;
+    m.sn = sn;
+    m.failed.resize((pn + 1) * (sn + 1));
+    return match(m, 0, 0);
+}
@@ -0,0 +1,50 @@
+#ifndef OSC_H
+#define OSC_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Reading Open Sound Control 1.0 packets in place. Nothing is copied or
+ * allocated, addresses and strings point into the packet.
+ */
+class OscMessage {
+    const char * types;
+    const char * p;
+    const char * end;
+
+    bool word(uint32_t & w);
+public:
+    const char * address;
+
+    bool parse(const char * s, size_t n);
+
+    // type tag of the next argument, '\0' after the last one
+    char peek() const { return *types; }
+    // numbers of any type, T and F as 1 and 0
+    bool get(float & f);
+    bool get(double & d);
+    bool get(bool & b);
+    bool get(const char *& s);
+    bool skip();
+};
+
+class OscHandler {
+public:
+    virtual ~OscHandler() { }
+    virtual void message(OscMessage & m) = 0;
+};
+
+// ntp format time tags, 1 means immediately
+typedef uint64_t OscTime;
+const OscTime OSC_IMMEDIATELY = 1;
+
+// false if it is no bundle
+bool oscBundleTime(const char * s, size_t n, OscTime & t);
+double oscUnixTime(OscTime t);
+// calls h.message() for every message of a packet, bundles included
+bool oscDispatch(const char * s, size_t n, OscHandler & h);
+// matches an address pattern (* ? [] {}) against a string. patterns of
+// more than 256 bytes never match.
+bool oscMatch(const char * p, size_t pn, const char * s, size_t sn);
+
+#endif
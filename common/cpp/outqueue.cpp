@@ -0,0 +1,195 @@
+#include "outqueue.h"
+#include <iostream>
+#include <cstdio>
+#include <cerrno>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+// iovecs handed to one writev
+const size_t IOV_BATCH = 64;
+// buffers larger than this are not kept after a spike
+const size_t POOL_MAX_CAPACITY = 64 * 1024;
+const size_t POOL_SIZE = 64;
+
+OutQueue::OutQueue(int _fd)
+: fd(_fd), mode(WRITE), own_fd(false), broken(false), write_pending(false),
+  head_written(0), low_limit(256 * 1024), limit(16 * 1024 * 1024), queued(0),
+  dropped(0), collapsed(0), writes(0)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == 0) {
+	if (S_ISSOCK(st.st_mode)) {
+	    mode = SEND;
+	} else if (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode)) {
+	    /*
+	     * get our own open file description, since setting O_NONBLOCK
+	     * on the one we inherited would also affect stdin and whoever
+	     * else shares it.
+	     */
+	    char path[64];
+	    int nfd;
+	    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	    nfd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	    if (nfd != -1) {
+		fd = nfd;
+		own_fd = true;
+	    } else {
+		std::cerr << "could not make output non blocking" << std::endl;
+	    }
+	}
+    }
+
+    event_set(&ev, fd, EV_WRITE, write_cb, this);
+}
+
+OutQueue::~OutQueue() {
+    if (write_pending) event_del(&ev);
+    while (!q.empty()) pop();
+    for (size_t i = 0; i < pool.size(); i++) delete pool[i];
+    if (own_fd) close(fd);
+}
+
+std::string * OutQueue::get_buffer() {
+    if (pool.empty()) return new std::string;
+    std::string * b = pool.back();
+    pool.pop_back();
+    return b;
+}
+
+void OutQueue::put_buffer(std::string * b) {
+    if (b->capacity() > POOL_MAX_CAPACITY || pool.size() >= POOL_SIZE) {
+	delete b;
+    } else {
+	b->clear();
+	pool.push_back(b);
+    }
+}
+
+void OutQueue::pop() {
+    message & m = q.front();
+    if (m.key) keyed.erase(keyed.find(*m.key));
+    put_buffer(m.data);
+    q.pop_front();
+}
+
+void OutQueue::schedule() {
+    if (!write_pending) {
+	event_add(&ev, NULL);
+	write_pending = true;
+    }
+}
+
+void OutQueue::push(const char * s, size_t n, priority p, const char * key) {
+    std::map<std::string, message*>::iterator it;
+
+    if (broken) return;
+
+    // replace a pending message with the same key, unless we are already
+    // in the middle of writing it
+    if (key && (it = keyed.find(key)) != keyed.end()) {
+	message * m = it->second;
+	if (m != &q.front() || !head_written) {
+	    queued -= m->data->size();
+	    m->data->assign(s, n);
+	    queued += n;
+	    collapsed++;
+	    return;
+	}
+    }
+
+    if ((p == LOW && queued + n > low_limit) || queued + n > limit) {
+	dropped++;
+	return;
+    }
+
+    message m;
+    m.data = get_buffer();
+    m.data->assign(s, n);
+    m.prio = p;
+    m.key = NULL;
+    q.push_back(m);
+    queued += n;
+
+    if (key) {
+	it = keyed.insert(std::pair<std::string, message*>(key, &q.back())).first;
+	q.back().key = &it->first;
+    }
+
+    schedule();
+}
+
+ssize_t OutQueue::write_some() {
+    struct iovec iov[IOV_BATCH];
+    std::deque<message>::iterator it;
+    size_t n = 0;
+
+    for (it = q.begin(); it != q.end() && n < IOV_BATCH; it++, n++) {
+	size_t skip = n ? 0 : head_written;
+	iov[n].iov_base = (char*)it->data->data() + skip;
+	iov[n].iov_len = it->data->size() - skip;
+    }
+
+    if (mode == SEND) {
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = n;
+	return sendmsg(fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    return writev(fd, iov, n);
+}
+
+void OutQueue::flush() {
+    write_pending = false;
+
+    while (!q.empty()) {
+	ssize_t r = write_some();
+
+	if (r < 0) {
+	    if (errno == EINTR) continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		schedule();
+		return;
+	    }
+	    std::cerr << "output failed: " << strerror(errno) << std::endl;
+	    broken = true;
+	    while (!q.empty()) pop();
+	    queued = 0;
+	    head_written = 0;
+	    return;
+	}
+	writes++;
+
+	size_t left = (size_t)r;
+	while (left && !q.empty()) {
+	    size_t rest = q.front().data->size() - head_written;
+	    if (left < rest) {
+		head_written += left;
+		break;
+	    }
+	    left -= rest;
+	    queued -= q.front().data->size();
+	    head_written = 0;
+	    pop();
+	}
+    }
+}
+
+// used on shutdown, when there is no event loop left to wait for
+void OutQueue::flush_sync(int timeout_ms) {
+    struct pollfd p;
+    p.fd = fd;
+    p.events = POLLOUT;
+
+    for (;;) {
+	flush();
+	if (q.empty() || broken) break;
+	if (poll(&p, 1, timeout_ms) <= 0) break;
+    }
+}
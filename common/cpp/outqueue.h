@@ -0,0 +1,69 @@
+#ifndef OUTQUEUE_H
+#define OUTQUEUE_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <event.h>
+
+/*
+ * Messages waiting to be written to a file descriptor without blocking.
+ * Writing happens from the event loop, so that a burst of messages ends
+ * up in a single writev. When the reader is slow, low priority messages
+ * are dropped, and those pushed with a key replace their pending
+ * predecessor with the same key.
+ */
+class OutQueue {
+public:
+    enum priority { NORMAL, LOW };
+
+private:
+    struct message {
+	std::string * data;
+	priority prio;
+	const std::string * key;
+    };
+
+    enum { WRITE, SEND };
+
+    int fd;
+    int mode;
+    bool own_fd;
+    bool broken;
+    bool write_pending;
+    size_t head_written;
+    std::deque<message> q;
+    std::vector<std::string*> pool;
+    std::map<std::string, message*> keyed;
+    struct event ev;
+
+    std::string * get_buffer();
+    void put_buffer(std::string *);
+    void pop();
+    void schedule();
+    ssize_t write_some();
+
+public:
+    // bytes queued before low priority messages are dropped
+    size_t low_limit;
+    // bytes queued before anything is dropped
+    size_t limit;
+    size_t queued;
+    unsigned long dropped;
+    unsigned long collapsed;
+    unsigned long writes;
+
+    OutQueue(int fd);
+    ~OutQueue();
+
+    void push(const char * s, size_t n, priority p = NORMAL,
+	      const char * key = NULL);
+    void flush();
+    void flush_sync(int timeout_ms);
+
+    static void write_cb(int fd, short flags, void *obj) {
+	((OutQueue*)obj)->flush();
+    }
+};
+#endif
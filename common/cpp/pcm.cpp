@@ -0,0 +1,426 @@
+#include "pcm.h"
+#include <string.h>
+#include <math.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define PCM_NEON
+#endif
+
+// 24 bit samples are widened to 32 bits in blocks of this many
+const size_t S24_BLOCK = 256;
+
+static inline int32_t load_s32(const unsigned char * p) {
+    int32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline float load_f32(const unsigned char * p) {
+    float v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline int16_t clip16(float f) {
+    f *= 32768.0f;
+    // nan is silence, like in the vector code
+    if (f != f) return 0;
+    if (f >= 32767.0f) return 32767;
+    if (f <= -32768.0f) return -32768;
+    // round to nearest even like the vector code
+    return (int16_t)lrintf(f);
+}
+
+void pcm_s32_to_f32(const void * in, float * out, size_t n) {
+    const unsigned char * p = (const unsigned char *)in;
+    const float scale = 1.0f / 2147483648.0f;
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 s = _mm_set1_ps(scale);
+    for (; i + 4 <= n; i += 4) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(p + 4*i));
+	_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(v), s));
+    }
+#elif defined(PCM_NEON)
+    for (; i + 4 <= n; i += 4) {
+	int32x4_t v = vreinterpretq_s32_u8(vld1q_u8(p + 4*i));
+	vst1q_f32(out + i, vcvtq_n_f32_s32(v, 31));
+    }
+#endif
+    for (; i < n; i++) out[i] = load_s32(p + 4*i) * scale;
+}
+
+void pcm_s32_to_s16(const void * in, int16_t * out, size_t n) {
+    const unsigned char * p = (const unsigned char *)in;
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 8 <= n; i += 8) {
+	__m128i a = _mm_loadu_si128((const __m128i *)(p + 4*i));
+	__m128i b = _mm_loadu_si128((const __m128i *)(p + 4*i + 16));
+	a = _mm_srai_epi32(a, 16);
+	b = _mm_srai_epi32(b, 16);
+	_mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(a, b));
+    }
+#elif defined(PCM_NEON)
+    for (; i + 4 <= n; i += 4) {
+	int32x4_t v = vreinterpretq_s32_u8(vld1q_u8(p + 4*i));
+	vst1_s16(out + i, vshrn_n_s32(v, 16));
+    }
+#endif
+    for (; i < n; i++) out[i] = (int16_t)(load_s32(p + 4*i) >> 16);
+}
+
+void pcm_f32_to_s16(const void * in, int16_t * out, size_t n) {
+    const unsigned char * p = (const unsigned char *)in;
+    size_t i = 0;
+#if defined(__SSE2__)
+    // cvtps rounds to nearest, packs saturates. nan is masked to 0 first,
+    // min would turn it into the maximum.
+    const __m128 s = _mm_set1_ps(32768.0f);
+    const __m128 hi = _mm_set1_ps(32767.0f);
+    for (; i + 8 <= n; i += 8) {
+	__m128 a = _mm_mul_ps(_mm_loadu_ps((const float *)(p + 4*i)), s);
+	__m128 b = _mm_mul_ps(_mm_loadu_ps((const float *)(p + 4*i + 16)), s);
+	a = _mm_min_ps(_mm_and_ps(a, _mm_cmpord_ps(a, a)), hi);
+	b = _mm_min_ps(_mm_and_ps(b, _mm_cmpord_ps(b, b)), hi);
+	_mm_storeu_si128((__m128i *)(out + i),
+			 _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+    }
+#elif defined(PCM_NEON)
+    // vcvtq truncates, so round first. nan converts to 0.
+#if !defined(__aarch64__)
+    const float32x4_t half = vdupq_n_f32(0.5f);
+    const uint32x4_t sign = vdupq_n_u32(0x80000000);
+#endif
+    for (; i + 4 <= n; i += 4) {
+	float32x4_t v = vmulq_n_f32(vreinterpretq_f32_u8(vld1q_u8(p + 4*i)), 32768.0f);
+#if defined(__aarch64__)
+	int32x4_t r = vcvtnq_s32_f32(v);
+#else
+	// away from zero on halves, which armv7 has no instruction for
+	int32x4_t r = vcvtq_s32_f32(vaddq_f32(v, vreinterpretq_f32_u32(
+	    vorrq_u32(vandq_u32(vreinterpretq_u32_f32(v), sign),
+		      vreinterpretq_u32_f32(half)))));
+#endif
+	vst1_s16(out + i, vqmovn_s32(r));
+    }
+#endif
+    for (; i < n; i++) out[i] = clip16(load_f32(p + 4*i));
+}
+
+void pcm_s16_to_f32(const void * in, float * out, size_t n) {
+    const unsigned char * p = (const unsigned char *)in;
+    const float scale = 1.0f / 32768.0f;
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 s = _mm_set1_ps(scale);
+    for (; i + 8 <= n; i += 8) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(p + 2*i));
+	// sign extend by unpacking into the upper halves
+	__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+	__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+	_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), s));
+	_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), s));
+    }
+#elif defined(PCM_NEON)
+    for (; i + 4 <= n; i += 4) {
+	int16x4_t v = vreinterpret_s16_u8(vld1_u8(p + 2*i));
+	vst1q_f32(out + i, vcvtq_n_f32_s32(vmovl_s16(v), 15));
+    }
+#endif
+    for (; i < n; i++) out[i] = (int16_t)(p[2*i] | p[2*i + 1] << 8) * scale;
+}
+
+void pcm_u8_to_f32(const void * in, float * out, size_t n) {
+    const unsigned char * p = (const unsigned char *)in;
+    for (size_t i = 0; i < n; i++) out[i] = (p[i] - 128) * (1.0f / 128.0f);
+}
+
+void pcm_f32_to_f32(const void * in, float * out, size_t n) {
+    memcpy(out, in, n * sizeof(float));
+}
+
+// widens 24 bit samples to the top of 32 bits
+static void s24_to_s32(const unsigned char * p, int32_t * out, size_t n) {
+    for (size_t i = 0; i < n; i++, p += 3)
+	out[i] = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16
+			   | (uint32_t)p[2] << 24);
+}
+
+void pcm_s24_to_f32(const void * in, float * out, size_t n) {
+    const unsigned char * p = (const unsigned char *)in;
+    int32_t block[S24_BLOCK];
+    size_t k;
+
+    while (n) {
+	k = n < S24_BLOCK ? n : S24_BLOCK;
+	s24_to_s32(p, block, k);
+	pcm_s32_to_f32(block, out, k);
+	p += 3*k;
+	out += k;
+	n -= k;
+    }
+}
+
+void pcm_s24_to_s16(const void * in, int16_t * out, size_t n) {
+    const unsigned char * p = (const unsigned char *)in;
+    int32_t block[S24_BLOCK];
+    size_t k;
+
+    while (n) {
+	k = n < S24_BLOCK ? n : S24_BLOCK;
+	s24_to_s32(p, block, k);
+	pcm_s32_to_s16(block, out, k);
+	p += 3*k;
+	out += k;
+	n -= k;
+    }
+}
+
+// G.711 mu-law, all 256 codes
+static int16_t mulaw[256];
+
+static void mulaw_init() {
+    for (int i = 0; i < 256; i++) {
+	int u = ~i & 0xff;
+	int s = (((u & 0x0f) << 3) + 0x84) << ((u >> 4) & 7);
+	mulaw[i] = (int16_t)(u & 0x80 ? 0x84 - s : s - 0x84);
+    }
+}
+
+void pcm_mulaw_to_s16(const void * in, int16_t * out, size_t n) {
+    const unsigned char * p = (const unsigned char *)in;
+    size_t i = 0;
+
+    // code 0 is the only one decoding to -32124
+    if (!mulaw[0]) mulaw_init();
+    for (; i + 4 <= n; i += 4) {
+	out[i] = mulaw[p[i]];
+	out[i + 1] = mulaw[p[i + 1]];
+	out[i + 2] = mulaw[p[i + 2]];
+	out[i + 3] = mulaw[p[i + 3]];
+    }
+    for (; i < n; i++) out[i] = mulaw[p[i]];
+}
+
+static const int16_t ima_steps[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37,
+    41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173,
+    190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658,
+    724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484,
+    7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818,
+    18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int ima_adjust[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+// the difference each nibble makes at each step index, and the next index,
+// so decoding a nibble is two lookups instead of the shifts and branches.
+// filled on first use, like the mu-law table.
+static int32_t ima_diff[89][16];
+static uint8_t ima_next[89][16];
+
+static void ima_init() {
+    for (int i = 0; i < 89; i++) {
+	int step = ima_steps[i];
+	for (int n = 0; n < 16; n++) {
+	    int d = step >> 3;
+	    if (n & 1) d += step >> 2;
+	    if (n & 2) d += step >> 1;
+	    if (n & 4) d += step;
+	    ima_diff[i][n] = n & 8 ? -d : d;
+	    int j = i + ima_adjust[n & 7];
+	    ima_next[i][n] = j < 0 ? 0 : j > 88 ? 88 : j;
+	}
+    }
+}
+
+struct ImaState {
+    int32_t pred;
+    unsigned int index;
+
+    inline int16_t step(unsigned int nibble) {
+	pred += ima_diff[index][nibble];
+	if (pred > 32767) pred = 32767;
+	else if (pred < -32768) pred = -32768;
+	index = ima_next[index][nibble];
+	return (int16_t)pred;
+    }
+};
+
+size_t pcm_ima_frames(unsigned int block_size, unsigned int channels) {
+    if (!channels || block_size <= 4 * channels
+	|| (block_size - 4 * channels) % (4 * channels))
+	return 0;
+    return (block_size - 4 * channels) * 2 / channels + 1;
+}
+
+size_t pcm_ima_to_s16(const void * in, int16_t * out, size_t blocks,
+		      unsigned int block_size, unsigned int channels) {
+    const unsigned char * p = (const unsigned char *)in;
+    size_t frames = pcm_ima_frames(block_size, channels);
+    size_t groups;
+    ImaState st[8];
+
+    if (!frames || channels > 8) return 0;
+    if (!ima_next[0][4]) ima_init();
+    groups = (block_size - 4 * channels) / (4 * channels);
+
+    for (size_t b = 0; b < blocks; b++) {
+	// the header holds the first sample of each channel
+	for (unsigned int c = 0; c < channels; c++, p += 4) {
+	    st[c].pred = (int16_t)(p[0] | p[1] << 8);
+	    st[c].index = p[2] > 88 ? 88 : p[2];
+	    out[c] = (int16_t)st[c].pred;
+	}
+	// then 8 samples at a time per channel, low nibble first
+	for (size_t g = 0; g < groups; g++) {
+	    for (unsigned int c = 0; c < channels; c++, p += 4) {
+		int16_t * o = out + (1 + 8 * g) * channels + c;
+		for (int k = 0; k < 4; k++) {
+		    o[(2 * k) * channels] = st[c].step(p[k] & 0x0f);
+		    o[(2 * k + 1) * channels] = st[c].step(p[k] >> 4);
+		}
+	    }
+	}
+	out += frames * channels;
+    }
+    return blocks * frames;
+}
+
+// the vector loops below take samples in groups of an even size, so lane k
+// always holds channel k % channels when there are one or two
+static inline bool lanes_match(unsigned int channels) {
+    return channels == 1 || channels == 2;
+}
+
+void pcm_levels_s16(const void * in, size_t n, unsigned int channels,
+		    float * peak, float * sum_squares) {
+    const unsigned char * p = (const unsigned char *)in;
+    const float scale = 1.0f / 32768.0f;
+    int32_t pk[8] = { 0 };
+    float sq[8] = { 0.0f };
+    size_t i = 0;
+    unsigned int c;
+
+    n *= channels;
+#if defined(__SSE2__)
+    if (lanes_match(channels)) {
+	__m128i hi = _mm_set1_epi16(0), lo = _mm_set1_epi16(0);
+	__m128 acc = _mm_setzero_ps();
+	int16_t h[8], l[8];
+	for (; i + 8 <= n; i += 8) {
+	    __m128i v = _mm_loadu_si128((const __m128i *)(p + 2*i));
+	    __m128 a = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+	    __m128 b = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+	    hi = _mm_max_epi16(hi, v);
+	    lo = _mm_min_epi16(lo, v);
+	    acc = _mm_add_ps(acc, _mm_add_ps(_mm_mul_ps(a, a), _mm_mul_ps(b, b)));
+	}
+	_mm_storeu_si128((__m128i *)h, hi);
+	_mm_storeu_si128((__m128i *)l, lo);
+	_mm_storeu_ps(sq, acc);
+	for (c = 0; c < 8; c++) pk[c] = h[c] > -l[c] ? h[c] : -l[c];
+    }
+#elif defined(PCM_NEON)
+    if (lanes_match(channels)) {
+	int16x8_t hi = vdupq_n_s16(0), lo = vdupq_n_s16(0);
+	float32x4_t acc = vdupq_n_f32(0.0f);
+	int16_t h[8], l[8];
+	for (; i + 8 <= n; i += 8) {
+	    int16x8_t v = vreinterpretq_s16_u8(vld1q_u8(p + 2*i));
+	    float32x4_t a = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+	    float32x4_t b = vcvtq_f32_s32(vmovl_s16(vget_high_s16(v)));
+	    hi = vmaxq_s16(hi, v);
+	    lo = vminq_s16(lo, v);
+	    acc = vmlaq_f32(vmlaq_f32(acc, a, a), b, b);
+	}
+	vst1q_s16(h, hi);
+	vst1q_s16(l, lo);
+	vst1q_f32(sq, acc);
+	for (c = 0; c < 8; c++) pk[c] = h[c] > -l[c] ? h[c] : -l[c];
+    }
+#endif
+    for (c = 0; c < channels; c++) {
+	peak[c] = 0.0f;
+	sum_squares[c] = 0.0f;
+    }
+    for (c = 0; c < 8 && i; c++) {
+	if (pk[c] * scale > peak[c % channels]) peak[c % channels] = pk[c] * scale;
+	sum_squares[c % channels] += sq[c] * (scale * scale);
+    }
+    for (; i < n; i++) {
+	float v = (int16_t)(p[2*i] | p[2*i + 1] << 8) * scale;
+	c = i % channels;
+	if (fabsf(v) > peak[c]) peak[c] = fabsf(v);
+	sum_squares[c] += v * v;
+    }
+}
+
+void pcm_levels_f32(const void * in, size_t n, unsigned int channels,
+		    float * peak, float * sum_squares) {
+    const unsigned char * p = (const unsigned char *)in;
+    float pk[4] = { 0.0f }, sq[4] = { 0.0f };
+    size_t i = 0;
+    unsigned int c;
+
+    n *= channels;
+#if defined(__SSE2__)
+    if (lanes_match(channels)) {
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	__m128 hi = _mm_setzero_ps(), acc = _mm_setzero_ps();
+	for (; i + 4 <= n; i += 4) {
+	    __m128 v = _mm_loadu_ps((const float *)(p + 4*i));
+	    hi = _mm_max_ps(hi, _mm_andnot_ps(sign, v));
+	    acc = _mm_add_ps(acc, _mm_mul_ps(v, v));
+	}
+	_mm_storeu_ps(pk, hi);
+	_mm_storeu_ps(sq, acc);
+    }
+#elif defined(PCM_NEON)
+    if (lanes_match(channels)) {
+	float32x4_t hi = vdupq_n_f32(0.0f), acc = vdupq_n_f32(0.0f);
+	for (; i + 4 <= n; i += 4) {
+	    float32x4_t v = vreinterpretq_f32_u8(vld1q_u8(p + 4*i));
+	    hi = vmaxq_f32(hi, vabsq_f32(v));
+	    acc = vmlaq_f32(acc, v, v);
+	}
+	vst1q_f32(pk, hi);
+	vst1q_f32(sq, acc);
+    }
+#endif
+    for (c = 0; c < channels; c++) {
+	peak[c] = 0.0f;
+	sum_squares[c] = 0.0f;
+    }
+    for (c = 0; c < 4 && i; c++) {
+	if (pk[c] > peak[c % channels]) peak[c % channels] = pk[c];
+	sum_squares[c % channels] += sq[c];
+    }
+    for (; i < n; i++) {
+	float v = load_f32(p + 4*i);
+	c = i % channels;
+	if (fabsf(v) > peak[c]) peak[c] = fabsf(v);
+	sum_squares[c] += v * v;
+    }
+}
+
+void pcm_levels_u8(const void * in, size_t n, unsigned int channels,
+		   float * peak, float * sum_squares) {
+    const unsigned char * p = (const unsigned char *)in;
+    unsigned int c;
+
+    for (c = 0; c < channels; c++) {
+	peak[c] = 0.0f;
+	sum_squares[c] = 0.0f;
+    }
+    for (size_t i = 0; i < n * channels; i++) {
+	float v = (p[i] - 128) * (1.0f / 128.0f);
+	c = i % channels;
+	if (fabsf(v) > peak[c]) peak[c] = fabsf(v);
+	sum_squares[c] += v * v;
+    }
+}
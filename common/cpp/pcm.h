@@ -0,0 +1,45 @@
+#ifndef PCM_H
+#define PCM_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Sample format conversion for streaming. Input is little endian as in
+ * wave files and may be unaligned, n counts samples, not frames. Floats
+ * are in [-1, 1), and are clipped when converted to integers. Uses SSE2 or
+ * NEON where available.
+ */
+void pcm_s24_to_f32(const void * in, float * out, size_t n);
+void pcm_s24_to_s16(const void * in, int16_t * out, size_t n);
+void pcm_s32_to_f32(const void * in, float * out, size_t n);
+void pcm_s32_to_s16(const void * in, int16_t * out, size_t n);
+void pcm_f32_to_s16(const void * in, int16_t * out, size_t n);
+void pcm_s16_to_f32(const void * in, float * out, size_t n);
+void pcm_u8_to_f32(const void * in, float * out, size_t n);
+// only copies, for unaligned input
+void pcm_f32_to_f32(const void * in, float * out, size_t n);
+
+/*
+ * Decoders for compressed wave data. mu-law takes a byte per sample. IMA
+ * ADPCM comes in blocks of block_size bytes as in wave files, each holding
+ * pcm_ima_frames() frames; 0 means the block size is not valid.
+ */
+void pcm_mulaw_to_s16(const void * in, int16_t * out, size_t n);
+size_t pcm_ima_frames(unsigned int block_size, unsigned int channels);
+// returns the number of frames written
+size_t pcm_ima_to_s16(const void * in, int16_t * out, size_t blocks,
+		      unsigned int block_size, unsigned int channels);
+
+/*
+ * Levels of interleaved samples for metering: the peak and the sum of
+ * squares of each channel, as fractions of full scale. n counts frames
+ * here. The vector code is used for one and two channels.
+ */
+void pcm_levels_s16(const void * in, size_t n, unsigned int channels,
+		    float * peak, float * sum_squares);
+void pcm_levels_f32(const void * in, size_t n, unsigned int channels,
+		    float * peak, float * sum_squares);
+void pcm_levels_u8(const void * in, size_t n, unsigned int channels,
+		   float * peak, float * sum_squares);
+
+#endif
@@ -0,0 +1,160 @@
+#include "resample.h"
+#include <math.h>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RESAMPLE_NEON
+#endif
+
+// kaiser window shape, about 80 dB stopband
+const double KAISER_BETA = 8.0;
+// where the passband ends, as a fraction of the lower nyquist frequency
+const double ROLLOFF = 0.95;
+// history is only cut when this many frames are done with
+const size_t DROP_AFTER = 4096;
+
+static unsigned int gcd(unsigned int a, unsigned int b) {
+    while (b) {
+	unsigned int t = a % b;
+	a = b;
+	b = t;
+    }
+    return a;
+}
+
+// modified bessel function of order zero
+static double bessel_i0(double x) {
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 50; k++) {
+	term *= (x / (2 * k)) * (x / (2 * k));
+	sum += term;
+	if (term < sum * 1e-12) break;
+    }
+    return sum;
+}
+
+static inline float dot(const float * a, const float * b, unsigned int n) {
+    unsigned int i = 0;
+    float sum;
+#if defined(__SSE__)
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4)
+	acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    sum = _mm_cvtss_f32(acc);
+#elif defined(RESAMPLE_NEON)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4)
+	acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+    float32x2_t s = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    sum = vget_lane_f32(vpadd_f32(s, s), 0);
+#else
+    sum = 0.0f;
+#endif
+    for (; i < n; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+bool Resampler::supported(unsigned int in_rate, unsigned int out_rate) {
+    return in_rate && out_rate && out_rate / gcd(in_rate, out_rate) <= MAX_PHASES;
+}
+
+Resampler::Resampler(unsigned int in_rate, unsigned int out_rate,
+		     unsigned int _channels) : channels(_channels), first(0),
+					       fed(0), produced(0) {
+    unsigned int g = gcd(in_rate, out_rate);
+    double ratio, fc, norm;
+
+    if (!supported(in_rate, out_rate) || !channels)
+	throw("unsupported resampling ratio");
+
+    L = out_rate / g;
+    M = in_rate / g;
+    ratio = L < M ? (double)L / M : 1.0;
+
+    // a lower cutoff needs a longer filter for the same steepness
+    half = (unsigned int)ceil(HALF_TAPS / ratio);
+    half += half & 1;
+    taps = 2 * half;
+    fc = 0.5 * ratio * ROLLOFF;
+    norm = bessel_i0(KAISER_BETA);
+
+    filter.resize((size_t)L * taps);
+    for (unsigned int p = 0; p < L; p++) {
+	float * h = &filter[(size_t)p * taps];
+	double sum = 0.0;
+	for (unsigned int j = 0; j < taps; j++) {
+	    // distance of the input frame from the output frame
+	    double x = (double)j - half + 1 - (double)p / L;
+	    double s = x == 0.0 ? 1.0 : sin(2 * M_PI * fc * x) / (2 * M_PI * fc * x);
+	    double w = x / half;
+	    w = w * w < 1.0 ? bessel_i0(KAISER_BETA * sqrt(1.0 - w * w)) / norm : 0.0;
+	    h[j] = (float)(s * w);
+	    sum += h[j];
+	}
+	// unity gain at dc for every phase
+	for (unsigned int j = 0; j < taps; j++) h[j] = (float)(h[j] / sum);
+    }
+
+    // the first output frame looks back half - 1 frames
+    hist.resize(channels);
+    for (unsigned int c = 0; c < channels; c++)
+	hist[c].assign(half - 1, 0.0f);
+    first = -(int64_t)(half - 1);
+}
+
+uint64_t Resampler::out_frames(uint64_t n) const {
+    return (n * L + M - 1) / M;
+}
+
+void Resampler::process(const float * in, size_t frames, std::vector<float> & out) {
+    for (unsigned int c = 0; c < channels; c++) {
+	std::vector<float> & h = hist[c];
+	size_t n = h.size();
+	h.resize(n + frames);
+	for (size_t i = 0; i < frames; i++) h[n + i] = in[i * channels + c];
+    }
+    fed += frames;
+    run(out_frames(fed), out);
+}
+
+void Resampler::flush(std::vector<float> & out) {
+    for (unsigned int c = 0; c < channels; c++)
+	hist[c].resize(hist[c].size() + half, 0.0f);
+    run(out_frames(fed), out);
+}
+
+// produces the output frames up to limit which have all their input
+void Resampler::run(uint64_t limit, std::vector<float> & out) {
+    int64_t last = first + (int64_t)hist[0].size() - 1;
+    // output frame k needs input up to k * M / L + half
+    int64_t top = last - (int64_t)half + 1;
+    uint64_t n, k;
+    size_t o;
+
+    if (top <= 0) return;
+    n = ((uint64_t)top * L + M - 1) / M;
+    if (n > limit) n = limit;
+    if (n <= produced) return;
+
+    o = out.size();
+    out.resize(o + (n - produced) * channels);
+    for (k = produced; k < n; k++) {
+	uint64_t t = k * M;
+	int64_t start = (int64_t)(t / L) - half + 1 - first;
+	const float * h = &filter[(size_t)(t % L) * taps];
+	for (unsigned int c = 0; c < channels; c++)
+	    out[o++] = dot(&hist[c][start], h, taps);
+    }
+    produced = n;
+
+    // forget the input no output frame will look at again
+    int64_t drop = (int64_t)(produced * M / L) - half + 1 - first;
+    if (drop > (int64_t)DROP_AFTER) {
+	for (unsigned int c = 0; c < channels; c++)
+	    hist[c].erase(hist[c].begin(), hist[c].begin() + drop);
+	first += drop;
+    }
+}
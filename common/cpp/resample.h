@@ -0,0 +1,46 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Polyphase windowed sinc resampler for interleaved float frames. Input is
+ * fed in blocks of any size, output is appended to a vector. The rate ratio
+ * is reduced to out/in = L/M, and a filter is kept for each of the L
+ * phases, so only ratios with a moderate L are supported (all the common
+ * ones are). Dot products use SSE or NEON where available.
+ *
+ *   Resampler r(44100, 48000, 2);
+ *   while (...) r.process(block, frames, out);
+ *   r.flush(out);
+ */
+class Resampler {
+public:
+    static const unsigned int MAX_PHASES = 4096;
+    // zero crossings of the sinc on each side, when not downsampling
+    static const unsigned int HALF_TAPS = 16;
+
+    Resampler(unsigned int in_rate, unsigned int out_rate, unsigned int channels);
+
+    static bool supported(unsigned int in_rate, unsigned int out_rate);
+
+    // output frames for a signal of n input frames
+    uint64_t out_frames(uint64_t n) const;
+
+    void process(const float * in, size_t frames, std::vector<float> & out);
+    // produces the rest of the output, once all input was fed
+    void flush(std::vector<float> & out);
+
+private:
+    unsigned int L, M, channels;
+    unsigned int half, taps;
+    std::vector<float> filter;		// L phases of taps each
+    std::vector<std::vector<float> > hist;	// per channel, from first on
+    int64_t first;			// input frame of hist[c][0]
+    uint64_t fed, produced;
+
+    void run(uint64_t limit, std::vector<float> & out);
+};
+
+#endif
@@ -0,0 +1,145 @@
+#include "websocket.h"
+#include <string.h>
+
+static const char * WS_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+static inline uint32_t rol(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+static void sha1_block(uint32_t h[5], const unsigned char * p) {
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+    int i;
+
+    for (i = 0; i < 16; i++)
+	w[i] = (uint32_t)p[i*4] << 24 | (uint32_t)p[i*4+1] << 16
+	       | (uint32_t)p[i*4+2] << 8 | p[i*4+3];
+    for (; i < 80; i++)
+	w[i] = rol(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+    for (i = 0; i < 80; i++) {
+	if (i < 20) {
+	    f = (b & c) | (~b & d);
+	    k = 0x5a827999;
+	} else if (i < 40) {
+	    f = b ^ c ^ d;
+	    k = 0x6ed9eba1;
+	} else if (i < 60) {
+	    f = (b & c) | (b & d) | (c & d);
+	    k = 0x8f1bbcdc;
+	} else {
+	    f = b ^ c ^ d;
+	    k = 0xca62c1d6;
+	}
+	t = rol(a, 5) + f + e + k + w[i];
+	e = d; d = c; c = rol(b, 30); b = a; a = t;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+void sha1(const void * data, size_t n, unsigned char digest[20]) {
+    uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+		      0xc3d2e1f0 };
+    const unsigned char * p = (const unsigned char *)data;
+    unsigned char block[64];
+    uint64_t bits = (uint64_t)n * 8;
+    size_t rest;
+    int i;
+
+    for (; n >= 64; n -= 64, p += 64) sha1_block(h, p);
+
+    // padding, with the length in the last 8 bytes
+    rest = n;
+    memcpy(block, p, rest);
+    block[rest++] = 0x80;
+    if (rest > 56) {
+	memset(block + rest, 0, 64 - rest);
+	sha1_block(h, block);
+	rest = 0;
+    }
+    memset(block + rest, 0, 56 - rest);
+    for (i = 0; i < 8; i++) block[56 + i] = (unsigned char)(bits >> (56 - 8*i));
+    sha1_block(h, block);
+
+    for (i = 0; i < 20; i++) digest[i] = (unsigned char)(h[i/4] >> (24 - 8*(i%4)));
+}
+
+std::string base64(const unsigned char * s, size_t n) {
+    static const char * tab =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    size_t i;
+
+    out.reserve((n + 2) / 3 * 4);
+    for (i = 0; i + 2 < n; i += 3) {
+	uint32_t v = s[i] << 16 | s[i+1] << 8 | s[i+2];
+	out += tab[v >> 18];
+	out += tab[(v >> 12) & 63];
+	out += tab[(v >> 6) & 63];
+	out += tab[v & 63];
+    }
+    if (i < n) {
+	uint32_t v = s[i] << 16 | (i + 1 < n ? s[i+1] << 8 : 0);
+	out += tab[v >> 18];
+	out += tab[(v >> 12) & 63];
+	out += i + 1 < n ? tab[(v >> 6) & 63] : '=';
+	out += '=';
+    }
+    return out;
+}
+
+std::string wsAccept(const std::string & key) {
+    std::string s = key + WS_GUID;
+    unsigned char digest[20];
+    sha1(s.data(), s.size(), digest);
+    return base64(digest, sizeof(digest));
+}
+
+long wsParse(char * p, size_t n, WsFrame & f, size_t max) {
+    unsigned char * u = (unsigned char *)p;
+    size_t head = 2, len, i;
+    unsigned char * mask;
+
+    if (n < 2) return 0;
+    // clients must mask their frames
+    if (!(u[1] & 0x80)) return -1;
+    f.fin = u[0] & 0x80;
+    f.opcode = u[0] & 0x0f;
+    len = u[1] & 0x7f;
+    if (len == 126) {
+	if (n < 4) return 0;
+	len = (size_t)u[2] << 8 | u[3];
+	head = 4;
+    } else if (len == 127) {
+	uint64_t l = 0;
+	if (n < 10) return 0;
+	for (i = 0; i < 8; i++) l = l << 8 | u[2 + i];
+	if (l > max) return -1;
+	len = (size_t)l;
+	head = 10;
+    }
+    if (len > max) return -1;
+    if (n < head + 4 + len) return 0;
+
+    mask = u + head;
+    f.payload = p + head + 4;
+    f.length = len;
+    for (i = 0; i < len; i++) f.payload[i] ^= mask[i & 3];
+    return (long)(head + 4 + len);
+}
+
+void wsFrame(std::string & out, int opcode, const char * s, size_t n) {
+    out += (char)(0x80 | opcode);
+    if (n < 126) {
+	out += (char)n;
+    } else if (n < 65536) {
+	out += (char)126;
+	out += (char)(n >> 8);
+	out += (char)n;
+    } else {
+	out += (char)127;
+	for (int i = 7; i >= 0; i--) out += (char)((uint64_t)n >> (8*i));
+    }
+    out.append(s, n);
+}
@@ -0,0 +1,41 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The bits of RFC 6455 a server needs: the handshake key, and reading
+ * and writing frames. Transport is left to the caller.
+ */
+enum WsOpcode {
+    WS_CONTINUATION = 0x0,
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+    WS_CLOSE = 0x8,
+    WS_PING = 0x9,
+    WS_PONG = 0xa
+};
+
+struct WsFrame {
+    bool fin;
+    int opcode;
+    // unmasked in place
+    char * payload;
+    size_t length;
+};
+
+// Sec-WebSocket-Accept for a Sec-WebSocket-Key
+std::string wsAccept(const std::string & key);
+/*
+ * reads a masked client frame from the start of p. returns the bytes it
+ * takes, 0 if it is not complete yet and -1 if it is bad or larger than max
+ */
+long wsParse(char * p, size_t n, WsFrame & f, size_t max);
+// appends an unmasked server frame
+void wsFrame(std::string & out, int opcode, const char * s, size_t n);
+
+void sha1(const void * data, size_t n, unsigned char digest[20]);
+std::string base64(const unsigned char * s, size_t n);
+
+#endif
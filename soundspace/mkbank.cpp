@@ -0,0 +1,198 @@
+/*
+ * mkbank: packs wave files into a sound bank for soundspace.
+ *
+ *   cd sounds && mkbank ../effects.bank door.wav steps/gravel.wav
+ *
+ * Entries are named by the paths as given, which have to match the "file"
+ * of the sources, so run it from the sound path. The wave files are only
+ * checked for their chunks, soundspace checks the formats when it loads
+ * the bank.
+ */
+
+#include "soundbank.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+struct Entry {
+    std::string name;
+    ss_bank_entry e;
+
+    bool operator<(const Entry & o) const {
+	return name < o.name;
+    }
+};
+
+static uint32_t le32(const char * p) {
+    const unsigned char * u = (const unsigned char *)p;
+    return u[0] | u[1] << 8 | u[2] << 16 | (uint32_t)u[3] << 24;
+}
+
+static uint64_t align(uint64_t n) {
+    return (n + SS_BANK_ALIGN - 1) / SS_BANK_ALIGN * SS_BANK_ALIGN;
+}
+
+// finds the fmt and data chunks of a wave file, leaving the offset and
+// length of the samples in the file in the entry
+static void parse(Entry & en, FILE * f) {
+    char buf[8];
+    uint64_t size, pos = 12;
+    bool have_fmt = false, have_data = false;
+
+    if (fseek(f, 0, SEEK_END) || (long)(size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET))
+	throw("could not read file");
+    if (size < 12 || fread(buf, 1, 8, f) != 8 || memcmp(buf, "RIFF", 4)
+	|| fread(buf, 1, 4, f) != 4 || memcmp(buf, "WAVE", 4))
+	throw("not a riff wave file");
+
+    while (size - pos >= 8 && !have_data) {
+	if (fseek(f, pos, SEEK_SET) || fread(buf, 1, 8, f) != 8)
+	    throw("could not read file");
+	uint32_t len = le32(buf + 4);
+	uint64_t body = pos + 8;
+
+	if (!memcmp(buf, "fmt ", 4)) {
+	    if (len < 16 || len > size - body)
+		throw("bad wave format");
+	    en.e.format_len = len < sizeof(en.e.format) ? len : sizeof(en.e.format);
+	    if (fread(en.e.format, 1, en.e.format_len, f) != en.e.format_len)
+		throw("could not read file");
+	    en.e.rate = le32((const char *)en.e.format + 4);
+	    have_fmt = true;
+	} else if (!memcmp(buf, "data", 4)) {
+	    en.e.offset = body;
+	    en.e.length = len < size - body ? len : size - body;
+	    have_data = true;
+	}
+	// chunks are padded to an even size
+	pos = body + len + (len & 1);
+	if (pos > size) break;
+    }
+
+    if (!have_fmt) throw("bad wave format");
+    if (!have_data) throw("no data chunk");
+}
+
+// copies len bytes at from in the file named name to out
+static bool copy(const char * name, uint64_t from, uint64_t len, FILE * out) {
+    static char buf[1 << 16];
+    FILE * in = fopen(name, "rb");
+    bool ok = in && !fseek(in, from, SEEK_SET);
+
+    while (ok && len) {
+	size_t n = len < sizeof(buf) ? len : sizeof(buf);
+	ok = fread(buf, 1, n, in) == n && fwrite(buf, 1, n, out) == n;
+	len -= n;
+    }
+    if (in) fclose(in);
+    return ok;
+}
+
+// a bank which could not be written completely is removed again, unless
+// it went somewhere else than a plain file
+static int fail(FILE * out, const char * path, const char * what) {
+    struct stat st;
+    bool plain = !fstat(fileno(out), &st) && S_ISREG(st.st_mode);
+
+    std::cerr << path << ": " << what << std::endl;
+    fclose(out);
+    if (plain) remove(path);
+    return 1;
+}
+
+int main(int argc, char ** argv) {
+    std::vector<Entry> entries;
+    struct ss_bank_header head;
+    uint64_t pos;
+
+    if (argc < 3) {
+	std::cerr << "usage: " << argv[0] << " bank file.wav..." << std::endl;
+	return 2;
+    }
+
+    for (int i = 2; i < argc; i++) {
+	Entry en;
+
+	memset(&en.e, 0, sizeof(en.e));
+	en.name = argv[i];
+	if (en.name.size() >= SS_BANK_NAME) {
+	    std::cerr << argv[i] << ": name too long" << std::endl;
+	    return 1;
+	}
+	FILE * in = fopen(argv[i], "rb");
+	if (!in) {
+	    std::cerr << argv[i] << ": could not read file" << std::endl;
+	    return 1;
+	}
+	try {
+	    parse(en, in);
+	} catch (const char * e) {
+	    std::cerr << argv[i] << ": " << e << std::endl;
+	    fclose(in);
+	    return 1;
+	}
+	fclose(in);
+	memcpy(en.e.name, argv[i], en.name.size());
+	entries.push_back(en);
+    }
+
+    // soundspace looks names up by bisection
+    std::sort(entries.begin(), entries.end());
+    for (size_t i = 1; i < entries.size(); i++) {
+	if (entries[i].name == entries[i - 1].name) {
+	    std::cerr << entries[i].name << ": given twice" << std::endl;
+	    return 1;
+	}
+    }
+
+    memcpy(head.magic, SS_BANK_MAGIC, sizeof(head.magic));
+    head.version = SS_BANK_VERSION;
+    head.count = entries.size();
+
+    // the index, then the samples of each entry on a page of its own
+    pos = align(sizeof(head) + entries.size() * sizeof(ss_bank_entry));
+    std::vector<uint64_t> from(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+	from[i] = entries[i].e.offset;
+	entries[i].e.offset = pos;
+	pos = align(pos + entries[i].e.length);
+    }
+
+    FILE * out = fopen(argv[1], "wb");
+    if (!out) {
+	std::cerr << argv[1] << ": could not create file" << std::endl;
+	return 1;
+    }
+    if (fwrite(&head, sizeof(head), 1, out) != 1)
+	return fail(out, argv[1], "could not write file");
+    for (size_t i = 0; i < entries.size(); i++) {
+	if (fwrite(&entries[i].e, sizeof(ss_bank_entry), 1, out) != 1)
+	    return fail(out, argv[1], "could not write file");
+    }
+    // the files are read again one at a time, rather than all kept around
+    for (size_t i = 0; i < entries.size(); i++) {
+	const ss_bank_entry & e = entries[i].e;
+	if (fseek(out, e.offset, SEEK_SET))
+	    return fail(out, argv[1], "could not write file");
+	if (!copy(entries[i].name.c_str(), from[i], e.length, out)) {
+	    if (ferror(out)) return fail(out, argv[1], "could not write file");
+	    std::cerr << entries[i].name << ": could not read file" << std::endl;
+	    return fail(out, argv[1], "not written");
+	}
+    }
+    pos = ftell(out);
+    if (ferror(out)) return fail(out, argv[1], "could not write file");
+    if (fflush(out)) return fail(out, argv[1], "could not write file");
+    if (fclose(out)) {
+	std::cerr << argv[1] << ": could not write file" << std::endl;
+	return 1;
+    }
+
+    std::cerr << "packed " << entries.size() << " files, "
+	      << (pos >> 10) << " kB" << std::endl;
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef SOUNDBANK_H
+#define SOUNDBANK_H
+
+/*
+ * Sound banks: many wave files packed into one file, which soundspace maps
+ * once and shares between all the sources playing from it. Banks are made
+ * with mkbank and listed in "banks" in the configuration.
+ *
+ * The file starts with a header and an index of count entries, sorted by
+ * name. The samples of each entry follow, page aligned, as they were in the
+ * data chunk of the wave file. format holds the body of the fmt chunk, so a
+ * bank takes every format soundspace plays. Everything is little endian.
+ */
+
+#include <stdint.h>
+
+#define SS_BANK_MAGIC	"SSBANK\r\n"
+#define SS_BANK_VERSION	1
+#define SS_BANK_ALIGN	4096
+#define SS_BANK_NAME	112
+
+struct ss_bank_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+};
+
+struct ss_bank_entry {
+    char name[SS_BANK_NAME];	/* as in "file" of a source, 0 terminated */
+    uint8_t format[40];		/* the fmt chunk, zero padded */
+    uint32_t format_len;
+    uint32_t rate;
+    uint64_t offset;		/* of the samples, from the start of the bank */
+    uint64_t length;		/* bytes of samples */
+};
+
+#endif
@@ -1,23 +1,50 @@
 #include "interpol.h"
+#include "fastjson.h"
+#include "soundspace_shm.h"
+#include "soundbank.h"
+#include "osc.h"
+#include "websocket.h"
+#include "pcm.h"
+#include "resample.h"
 #include <time.h>
 #include <event.h>
+#include <evhttp.h>
 #include <csignal>
 #include <stdlib.h>
 #include <fstream>
+#include <sstream>
 #include <math.h>
 #include <unistd.h>
 #include <list>
+#include <map>
+#include <deque>
+#include <queue>
+#include <algorithm>
+#include <functional>
 #include <cmath>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <cstring>
 
 #include <AL/al.h>
 #include <AL/alc.h>
 
+// from alext.h, which not every OpenAL ships
+#ifndef AL_FORMAT_MONO_FLOAT32
+#define AL_FORMAT_MONO_FLOAT32 0x10010
+#define AL_FORMAT_STEREO_FLOAT32 0x10011
+#endif
+
 void interpol_callback(Json::Value&);
+bool fastCommand(const char *, size_t);
 
 Interpol comm = Interpol("soundspace", interpol_callback);
 Json::Value config;
@@ -64,6 +91,110 @@ static inline void Json2AL(Json::Value & v, bool & b) {
 const int NBUFFERS = 2;
 const int BUFFER_INTERVAL = 1000;
 
+// run time of a code path, in microseconds
+struct Timing {
+    unsigned long count;
+    double last, max, total;
+
+    Timing() : count(0), last(0.0), max(0.0), total(0.0) {}
+
+    void add(double us) {
+	count++;
+	last = us;
+	total += us;
+	if (us > max) max = us;
+    }
+};
+
+// adds the time until it goes out of scope to a Timing
+class Timed {
+    Timing & t;
+    struct timespec start;
+public:
+    Timed(Timing & _t) : t(_t) {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    ~Timed() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	t.add((now.tv_sec - start.tv_sec) * 1e6
+	      + (now.tv_nsec - start.tv_nsec) / 1e3);
+    }
+};
+
+struct Stats {
+    Timing animator;
+    Timing refill;
+    // sample format conversion, and the bytes it read
+    Timing convert;
+    unsigned long long convert_bytes;
+    // decoding compressed samples, and the compressed bytes
+    Timing decode;
+    unsigned long long decode_bytes;
+    // writing resampled copies of files, per block
+    Timing resample;
+    // measuring the levels of the chunks, see Buffer::meter()
+    Timing meter;
+    unsigned long underruns;
+    // page faults while refilling, and the bytes advised in and out
+    unsigned long major_faults, minor_faults;
+    unsigned long long prefetched, released;
+
+    Stats() : convert_bytes(0), decode_bytes(0), underruns(0),
+	      major_faults(0), minor_faults(0), prefetched(0), released(0) {}
+} stats;
+
+// adds the page faults until it goes out of scope to the stats
+class Faulted {
+    struct rusage start;
+public:
+    Faulted() {
+	getrusage(RUSAGE_SELF, &start);
+    }
+    ~Faulted() {
+	struct rusage now;
+	getrusage(RUSAGE_SELF, &now);
+	stats.major_faults += now.ru_majflt - start.ru_majflt;
+	stats.minor_faults += now.ru_minflt - start.ru_minflt;
+    }
+};
+
+// whether OpenAL takes float samples (AL_EXT_FLOAT32)
+bool al_float32 = false;
+// converted samples on their way to alBufferData
+std::vector<char> convert_buf;
+// chunks of looping sources, put together across the loop seam
+std::vector<char> splice_buf, splice_head;
+// the first chunks after a switch of files, and the old file under them
+std::vector<char> fade_buf, fade_tail;
+// the mixing rate of the device, and how many sources it can play
+unsigned int device_rate = 0;
+unsigned int device_sources = 0;
+// whether files at other rates are resampled to it, and where to keep them
+bool resample_files = false;
+std::string resample_cache = "/tmp/soundspace-resampled";
+
+// the parts of the mapped files which are asked to stay in memory, see
+// Buffer::advise(). over budget the readahead is cut to a single chunk,
+// and released pages are dropped from the page cache as well.
+struct Residency {
+    unsigned int readahead;	// chunks ahead of the read offset
+    size_t budget;		// bytes, 0 for no limit
+    size_t resident;		// bytes advised in and not released
+
+    Residency() : readahead(2), budget(0), resident(0) {}
+} residency;
+
+// whether the levels of the chunks are measured as they are queued. this
+// is switched on by the configuration, or by the first client asking.
+bool metering = false;
+// whether a client asked for them, which keeps them on across reloads
+bool metering_asked = false;
+// how often they are pushed to the clients subscribed to "meters"
+long meter_interval_ms = 100;
+// the levels are kept for each block of this many frames of a chunk
+const size_t METER_FRAMES = 1024;
+
 class Listener {
 public:
 #define fvFUN(name, FLAG)    ALfloat name ## value[3];			    \
@@ -113,12 +244,154 @@ public:
     }
 };
 
+// events clients can subscribe to
+enum {
+    NOTIFY_SOURCE_ENDED = 1 << 0,
+    NOTIFY_LOOP_WRAPPED = 1 << 1,
+    NOTIFY_ANIMATION_DONE = 1 << 2,
+    NOTIFY_UNDERRUN = 1 << 3,
+    NOTIFY_FILE_SWITCHED = 1 << 4,
+    NOTIFY_ALL = (1 << 5) - 1,
+    // pushed every interval rather than when something happens, so only
+    // sent to those asking for it by name
+    NOTIFY_METERS = 1 << 5
+};
+
+static const char * notify_names[] = {
+    "source_ended",
+    "loop_wrapped",
+    "animation_done",
+    "underrun",
+    "file_switched",
+    "meters"
+};
+
+static unsigned int notifyEvent(const std::string & name) {
+    for (unsigned int i = 0; i < sizeof(notify_names)/sizeof(*notify_names); i++) {
+	if (name == notify_names[i]) return 1 << i;
+    }
+    throw("unknown event");
+}
+
+static const char * notifyName(unsigned int event) {
+    for (unsigned int i = 0; i < sizeof(notify_names)/sizeof(*notify_names); i++) {
+	if (event == 1u << i) return notify_names[i];
+    }
+    return "unknown";
+}
+
+// push an event to the clients which subscribed to it. this is cheap if
+// nobody did.
+static void notify(unsigned int event, const std::string & id,
+		   const char * what = NULL) {
+    static JSONBuilder msg;
+
+    if (!(Interpol::all_events & event)) return;
+
+    msg.clear();
+    msg.object();
+    msg.key("src");
+    msg.add(comm.name);
+    msg.key("cmd");
+    msg.add("event");
+    msg.key("event");
+    msg.add(notifyName(event));
+    msg.key("id");
+    msg.add(id);
+    if (what) {
+	msg.key("what");
+	msg.add(what);
+    }
+    msg.end();
+    Interpol::broadcast(event, id, msg.buf);
+}
+
 // forward definition
 class Device;
 class Buffer;
 class Source;
 
+// a sound bank, mapped once for all the buffers playing from it
+class Bank {
+public:
+    std::string path;
+    int fd;
+    void * data;
+    struct stat st;
+    const struct ss_bank_entry * index;
+    uint32_t count;
+
+    Bank(const std::string & _path) : path(_path), data(NULL) {
+	fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+	    throw("could not open bank");
+	try {
+	    map();
+	} catch (const char * s) {
+	    if (data) munmap(data, st.st_size);
+	    close(fd);
+	    throw;
+	}
+    }
+
+    ~Bank() {
+	munmap(data, st.st_size);
+	close(fd);
+    }
+
+    // the entry of a file, or NULL. the index is sorted by name.
+    const struct ss_bank_entry * find(const std::string & name) {
+	uint32_t lo = 0, hi = count;
+	while (lo < hi) {
+	    uint32_t mid = (lo + hi) / 2;
+	    int c = strncmp(name.c_str(), index[mid].name, SS_BANK_NAME);
+	    if (!c) return &index[mid];
+	    if (c < 0) hi = mid;
+	    else lo = mid + 1;
+	}
+	return NULL;
+    }
+
+private:
+    void map() {
+	const struct ss_bank_header * head;
+
+	if (fstat(fd, &st) == -1)
+	    throw("could not stat bank");
+	if (st.st_size < (off_t)sizeof(*head))
+	    throw("bad bank header");
+
+	data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+	    data = NULL;
+	    throw("mmap failed");
+	}
+
+	head = (const struct ss_bank_header *)data;
+	if (memcmp(head->magic, SS_BANK_MAGIC, sizeof(head->magic))
+	    || head->version != SS_BANK_VERSION)
+	    throw("bad bank header");
+	count = head->count;
+	index = (const struct ss_bank_entry *)(head + 1);
+	if ((st.st_size - sizeof(*head)) / sizeof(*index) < count)
+	    throw("bad bank index");
+
+	// only the index is read here, the samples when they are played
+	for (uint32_t i = 0; i < count; i++) {
+	    const struct ss_bank_entry & e = index[i];
+	    if (!memchr(e.name, 0, SS_BANK_NAME)
+		|| e.offset > (uint64_t)st.st_size
+		|| e.length > (uint64_t)st.st_size - e.offset
+		|| (i && strncmp(index[i - 1].name, e.name, SS_BANK_NAME) >= 0))
+		throw("bad bank index");
+	}
+    }
+};
+
 class Buffer {
+    // writes the resampled copies, with the header of a wave file
+    friend class ResampleQueue;
+
     struct chunk {
 	char type[4];
 	unsigned int length;
@@ -128,22 +401,39 @@ class Buffer {
 	unsigned int length;
 	char wave[4];
     };
+    // the body of the "fmt " chunk
     struct wave_format {
-	char fmt[4];
-	unsigned int len;
 	unsigned short tag;
 	unsigned short channels;
 	unsigned int sample_rate;
 	unsigned int bytes_per_second;
 	unsigned short align;
 	unsigned short bits_per_sample;
+	// WAVE_FORMAT_EXTENSIBLE and IMA ADPCM only
+	unsigned short size;
+	union {
+	    unsigned short valid_bits;
+	    unsigned short samples_per_block;
+	};
+	unsigned int channel_mask;
+	unsigned short sub_format;
+	char guid[14];
     };
-    struct pcm_header {
-	char data[4];
-	unsigned int length;
+    enum {
+	WAVE_FORMAT_PCM = 1,
+	WAVE_FORMAT_IEEE_FLOAT = 3,
+	WAVE_FORMAT_MULAW = 7,
+	WAVE_FORMAT_IMA_ADPCM = 0x11,
+	WAVE_FORMAT_EXTENSIBLE = 0xfffe
     };
-#define HEADER_SIZE (long)(sizeof(struct riff_header) + sizeof(struct wave_format) + sizeof(struct pcm_header))
 public:
+    // samples in the file
+    enum encoding {
+	PCM_U8, PCM_S16, PCM_S24, PCM_S32, PCM_F32,
+	// compressed, decoded while streaming
+	MULAW, IMA_ADPCM
+    };
+
     ALuint id[NBUFFERS];
     void * data;
     int fd;
@@ -153,21 +443,175 @@ public:
     ALenum format;
     ALuint frequency;
     unsigned long interval;
+    std::string path;
+    bool lazy;
+    // the samples in the file, and how they are handed to OpenAL
+    size_t data_start, data_end;
+    encoding enc;
+    unsigned int channels;
+    // the file is read in blocks of block_frames frames, which is one
+    // frame except for ADPCM
+    unsigned int block_size;
+    unsigned int block_frames;
+    unsigned int sample_size;
+    bool direct;
+    bool warned_slow;
+    // frames of the next chunk not to play, after seeking into a block
+    size_t skip;
+    // the pages ahead of the offset which were advised in
+    size_t ahead_from, ahead_to;
+    // the bank holding the samples, which owns fd and mapping
+    Bank * bank;
+    // the buffer this one replaced, fading out under its first fade_frames
+    // frames. fade_src is the next frame of it.
+    Buffer * fading;
+    size_t fade_frames, fade_done, fade_src;
+    // whether the BufferCache still counts the fd and mapping of this
+    // buffer while it fades out
+    bool held;
+
+    // the chunks queued on the source, oldest first, in frames. a chunk of
+    // a looping source goes back to resume after wrap_at frames, and from
+    // then on repeats every period frames. levels holds the peak and rms of
+    // each channel for each METER_FRAMES frames, if metering.
+    struct queued_chunk {
+	size_t start;
+	size_t frames;
+	size_t wrap_at, resume, period;
+	std::vector<float> levels;
+    } queue[NBUFFERS];
+    unsigned int queue_head, queue_len;
 
     Buffer() {
 	data = NULL;
 	fd = -1;
+	lazy = false;
+	data_start = data_end = offset = skip = 0;
+	ahead_from = ahead_to = 0;
+	bank = NULL;
+	fading = NULL;
+	held = false;
+	queue_head = queue_len = 0;
 	alGenBuffers(NBUFFERS, id);
     }
 
     void fromFile(const char * f) {
+	path = f;
+	bank = NULL;
+	fading = NULL;
+	held = false;
+	load();
+    }
+
+    // the samples are in the bank already, so there is nothing to open
+    void fromBank(Bank * b, const struct ss_bank_entry * e) {
+	struct wave_format whead;
+
+	if (e->format_len < 16)
+	    throw("bad wave format");
+	memset(&whead, 0, sizeof(whead));
+	memcpy(&whead, e->format, std::min((size_t)e->format_len, sizeof(whead)));
+
+	bank = b;
+	fading = NULL;
+	held = false;
+	path = e->name;
+	data = b->data;
+	fd = b->fd;
+	st = b->st;
+	data_start = e->offset;
+	data_end = e->offset + e->length;
+	ahead_from = ahead_to = 0;
+	describe(whead, e->format_len, true);
+	if (resample_files && device_rate && frequency != device_rate)
+	    std::cerr << "Warning: '" << path << "' in bank '" << b->path
+		      << "' is played at " << frequency
+		      << " Hz, banks are not resampled" << std::endl;
+	alGenBuffers(NBUFFERS, id);
+    }
+
+    bool loaded() {
+	return data != NULL;
+    }
+
+    // a lazy buffer only checks that the file is there. the file is opened,
+    // mapped and parsed when the source is played for the first time.
+    void fromFileLazy(const char * f) {
+	data = NULL;
+	fd = -1;
+	lazy = true;
+	path = f;
+	bank = NULL;
+	fading = NULL;
+	held = false;
+	queue_head = queue_len = 0;
+
+	if (stat(f, &st) == -1)
+	    throw("could not stat file");
+
+	if (!S_ISREG (st.st_mode))
+	    throw("not a regular file");
+
+	data_start = data_end = offset = skip = 0;
+	ahead_from = ahead_to = 0;
+    }
+
+    void load() {
+	const char * f = path.c_str();
 	data = NULL;
+	ahead_from = ahead_to = 0;
 
 	fd = open(f, O_RDONLY);
 
 	if (fd == -1)
 	    throw("could not open file");
 
+	try {
+	    parse();
+	    // until its copy is written the file plays at its own rate
+	    std::string cached;
+	    if (needs_resampling() && !(cached = resampled()).empty()) {
+		munmap(data, st.st_size);
+		data = NULL;
+		close(fd);
+		fd = open(cached.c_str(), O_RDONLY);
+		if (fd == -1)
+		    throw("could not open resampled file");
+		parse(false);
+	    }
+	} catch (const char * s) {
+	    if (data && data != MAP_FAILED) munmap(data, st.st_size);
+	    data = NULL;
+	    close(fd);
+	    fd = -1;
+	    throw;
+	}
+	alGenBuffers(NBUFFERS, id);
+#ifdef TESTING
+	std::cerr << "generated " << NBUFFERS << " buffer " << *id << std::endl;
+#endif
+    }
+
+    // give back fd, mapping and AL buffers. the buffers must not be queued
+    // on a source anymore.
+    void unload() {
+	if (!loaded()) return;
+#ifdef TESTING
+	std::cerr << "unloading " << path << std::endl;
+#endif
+	alDeleteBuffers(NBUFFERS, id);
+	residency.resident -= ahead_to - ahead_from;
+	ahead_from = ahead_to = 0;
+	if (!bank) {
+	    munmap(data, st.st_size);
+	    close(fd);
+	}
+	data = NULL;
+	fd = -1;
+    }
+
+    // warn is false for resampled copies, which were checked already
+    void parse(bool warn = true) {
 	if (fstat(fd, &st) == -1)
 	    throw("could not stat file");
 
@@ -175,17 +619,17 @@ public:
 	    throw("not a regular file");
 
 #ifdef TESTING
-	std::cerr << "open file " << f << " with size " << st.st_size << std::endl;
+	std::cerr << "open file " << path << " with size " << st.st_size << std::endl;
 #endif
 
 	data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
 
 #ifdef TESTING
-	std::cerr << "mapped " << f << " to " << data << std::endl;
+	std::cerr << "mapped " << path << " to " << data << std::endl;
 #endif
 
 	if (data == MAP_FAILED) {
-	    close(fd);
+	    data = NULL;
 	    throw("mmap failed");
 	}
 
@@ -193,29 +637,17 @@ public:
 
 	{
 	    const struct riff_header * rhead;
-	    const struct wave_format * whead;
-	    const struct pcm_header * phead;
-	    const struct chunk * chead;
+	    const struct chunk * c;
 	    const char * buf = (const char *) data;
+	    const char * end = buf + st.st_size;
+	    struct wave_format whead;
+	    unsigned int fmt_len = 0;
 
-	    if (st.st_size < HEADER_SIZE) {
+	    if (st.st_size < (off_t)sizeof(struct riff_header)) {
 		throw("muha");
 	    }
 
 	    rhead = (const struct riff_header*)buf;
-	    buf += sizeof(struct riff_header);
-	    whead = (const struct wave_format*)buf;
-	    buf += sizeof(struct wave_format);
-
-	    chead = (const struct chunk*)buf;
-
-	    while (strncmp(chead->type, "data", 4)) {
-		buf += sizeof(struct chunk) + chead->length;
-		chead = (const struct chunk*)buf;
-	    }
-
-	    phead = (const struct pcm_header*)buf;
-	    buf += sizeof(struct pcm_header);
 
 	    if (strncmp(rhead->riff, "RIFF", 4) || strncmp(rhead->wave, "WAVE", 4)) {
 		throw("bad riff wave header");
@@ -224,54 +656,134 @@ public:
 	    if (rhead->length + 8 != st.st_size)
 		throw("someone is lying about the size of this wave");
 
-	    if (strncmp(whead->fmt, "fmt ", 4) || whead->len != 16)
+	    // walk the chunks up to the samples
+	    data_start = 0;
+	    buf += sizeof(struct riff_header);
+	    while (end - buf >= (long)sizeof(struct chunk)) {
+		const char * body = buf + sizeof(struct chunk);
+		c = (const struct chunk*)buf;
+
+		if (!strncmp(c->type, "fmt ", 4)) {
+		    fmt_len = c->length;
+		    if (fmt_len < 16 || (long)fmt_len > end - body)
+			throw("bad wave format");
+		    memset(&whead, 0, sizeof(whead));
+		    memcpy(&whead, body, fmt_len < sizeof(whead) ? fmt_len : sizeof(whead));
+		} else if (!strncmp(c->type, "data", 4)) {
+		    data_start = body - (const char *)data;
+		    data_end = data_start + c->length;
+		    if (data_end > (size_t)st.st_size) data_end = st.st_size;
+		    break;
+		}
+		// chunks are padded to an even size
+		buf = body + c->length + (c->length & 1);
+	    }
+
+	    if (!fmt_len)
 		throw("bad wave format");
 
-#ifdef TESTING
-	    std::cerr << "bits: " << whead->bits_per_sample
-		      << ", channels: " << whead->channels << std::endl;
-#endif
-	    if (whead->channels == 1) {
-		format = (whead->bits_per_sample == 8) ? AL_FORMAT_MONO8 : AL_FORMAT_MONO16;
-	    } else if (whead->channels == 2) {
-		std::cerr << "Warning: '" << f << "' contains stereo data and"
-			     " will be played without spatialization." << std::endl;
-		format = (whead->bits_per_sample == 8) ? AL_FORMAT_STEREO8 : AL_FORMAT_STEREO16;
-	    } else throw("bad number of channels");
+	    if (!data_start)
+		throw("bad pcm header");
 
-	    frequency = (ALuint)whead->sample_rate;
+	    describe(whead, fmt_len, warn);
+	}
+    }
 
-	    if (strncmp(phead->data, "data", 4))
-		throw("bad pcm header");
+    // takes the format of the samples from data_start to data_end
+    void describe(const struct wave_format & whead, unsigned int fmt_len,
+		  bool warn) {
+	const char * f = path.c_str();
+	unsigned int tag = whead.tag;
 
-	    offset = HEADER_SIZE;
-	    chunk_size = whead->bytes_per_second / 1000 * BUFFER_INTERVAL;
-	    interval = BUFFER_INTERVAL/2;
-
-	    chunk_size |= chunk_size >> 1;
-	    chunk_size |= chunk_size >> 2;
-	    chunk_size |= chunk_size >> 4;
-	    chunk_size |= chunk_size >> 8;
-	    chunk_size |= chunk_size >> 16;
-	    // poor man's autoconf
-	    if (sizeof(chunk_size) == 8)
-		chunk_size |= chunk_size >> 32;
-	    chunk_size += 1;
-
-	    if (2*chunk_size > (st.st_size - HEADER_SIZE)) {
-		chunk_size = (st.st_size - HEADER_SIZE) / 2;
-		interval = chunk_size * 1000 / whead->bytes_per_second;
-		interval /= 2;
-	    }
+	if (tag == WAVE_FORMAT_EXTENSIBLE && fmt_len >= 26)
+	    tag = whead.sub_format;
 
 #ifdef TESTING
-	    std::cerr << "buffering chunks of " << chunk_size << " bytes" << std::endl;
-	    std::cerr << "using interval of " << interval << " ms" << std::endl;
+	std::cerr << "format: " << tag << ", bits: " << whead.bits_per_sample
+		  << ", channels: " << whead.channels << std::endl;
 #endif
+	if (tag == WAVE_FORMAT_PCM) {
+	    switch (whead.bits_per_sample) {
+	    case 8: enc = PCM_U8; break;
+	    case 16: enc = PCM_S16; break;
+	    case 24: enc = PCM_S24; break;
+	    case 32: enc = PCM_S32; break;
+	    default: throw("unsupported bits per sample");
+	    }
+	} else if (tag == WAVE_FORMAT_IEEE_FLOAT && whead.bits_per_sample == 32) {
+	    enc = PCM_F32;
+	} else if (tag == WAVE_FORMAT_MULAW && whead.bits_per_sample == 8) {
+	    enc = MULAW;
+	} else if (tag == WAVE_FORMAT_IMA_ADPCM && whead.bits_per_sample == 4) {
+	    enc = IMA_ADPCM;
+	} else throw("unsupported wave format");
+
+	if (whead.channels != 1 && whead.channels != 2)
+	    throw("bad number of channels");
+	if (whead.channels == 2 && warn) {
+	    std::cerr << "Warning: '" << f << "' contains stereo data and"
+			 " will be played without spatialization." << std::endl;
 	}
-	alGenBuffers(NBUFFERS, id);
+
+	if (!whead.bytes_per_second)
+	    throw("bad wave format");
+
+	channels = whead.channels;
+	sample_size = whead.bits_per_sample / 8;
+	block_size = whead.align;
+	block_frames = 1;
+	if (enc == IMA_ADPCM) {
+	    block_frames = pcm_ima_frames(block_size, channels);
+	    if (!block_frames || (fmt_len >= 20
+				  && whead.samples_per_block != block_frames))
+		throw("bad block align");
+	} else if (block_size != sample_size * channels) {
+	    throw("bad block align");
+	}
+
+	// 8 and 16 bit (and float, if OpenAL takes it) are passed on as
+	// they are, anything else is converted while streaming. decoded
+	// samples fit 16 bits.
+	direct = enc == PCM_U8 || enc == PCM_S16 || (enc == PCM_F32 && al_float32);
+	warned_slow = false;
+	if (enc == PCM_U8) {
+	    format = whead.channels == 1 ? AL_FORMAT_MONO8 : AL_FORMAT_STEREO8;
+	} else if (enc != PCM_S16 && enc < MULAW && al_float32) {
+	    format = whead.channels == 1 ? AL_FORMAT_MONO_FLOAT32 : AL_FORMAT_STEREO_FLOAT32;
+	} else {
+	    format = whead.channels == 1 ? AL_FORMAT_MONO16 : AL_FORMAT_STEREO16;
+	}
+
+	frequency = (ALuint)whead.sample_rate;
+	queue_head = queue_len = 0;
+	skip = 0;
+
+	offset = data_start;
+	chunk_size = whead.bytes_per_second / 1000 * BUFFER_INTERVAL;
+	interval = BUFFER_INTERVAL/2;
+
+	chunk_size |= chunk_size >> 1;
+	chunk_size |= chunk_size >> 2;
+	chunk_size |= chunk_size >> 4;
+	chunk_size |= chunk_size >> 8;
+	chunk_size |= chunk_size >> 16;
+	// poor man's autoconf
+	if (sizeof(chunk_size) == 8)
+	    chunk_size |= chunk_size >> 32;
+	chunk_size += 1;
+
+	if (2*chunk_size > data_end - data_start) {
+	    chunk_size = (data_end - data_start) / 2;
+	    interval = chunk_size * 1000 / whead.bytes_per_second;
+	    interval /= 2;
+	}
+	// whole blocks only, 24 bit frames do not divide powers of two
+	chunk_size -= chunk_size % block_size;
+	if (chunk_size < block_size) chunk_size = block_size;
+
 #ifdef TESTING
-	std::cerr << "generated " << NBUFFERS << " buffer " << *id << std::endl;
+	std::cerr << "buffering chunks of " << chunk_size << " bytes" << std::endl;
+	std::cerr << "using interval of " << interval << " ms" << std::endl;
 #endif
     }
 
@@ -280,26 +792,157 @@ public:
     }
 
     const size_t left() {
-	return st.st_size - offset;
+	return data_end - offset;
     }
 
     void reset() {
-	offset = HEADER_SIZE;
+	offset = data_start;
+	skip = 0;
+    }
+
+    size_t frames() {
+	return (data_end - data_start) / block_size * block_frames;
+    }
+
+    // continue streaming at frame, without touching the file. the queue
+    // must have been emptied.
+    void seek(size_t frame) {
+	if (frame > frames()) frame = frames();
+	offset = data_start + frame / block_frames * block_size;
+	skip = frame % block_frames;
+	queue_head = queue_len = 0;
+    }
+
+    queued_chunk & chunk_queued(size_t start, size_t frames, size_t wrap_at,
+				size_t resume = 0, size_t period = 1) {
+	queued_chunk & c = queue[(queue_head + queue_len) % NBUFFERS];
+	c.start = start;
+	c.frames = frames;
+	c.wrap_at = wrap_at;
+	c.resume = resume;
+	c.period = period;
+	queue_len++;
+	return c;
+    }
+
+    void chunk_done() {
+	if (!queue_len) return;
+	queue_head = (queue_head + 1) % NBUFFERS;
+	queue_len--;
+    }
+
+    // the frame in the file which the source is playing, given its
+    // AL_SAMPLE_OFFSET into the queue
+    size_t play_frame(ALint sample) {
+	for (unsigned int i = 0; i < queue_len; i++) {
+	    queued_chunk & c = queue[(queue_head + i) % NBUFFERS];
+	    if ((size_t)sample < c.wrap_at) return c.start + sample;
+	    if ((size_t)sample < c.frames)
+		return c.resume + (sample - c.wrap_at) % c.period;
+	    sample -= c.frames;
+	}
+	return next_frame() - skip;
     }
 
+    // the peak and rms of each channel where the source is playing, given
+    // its AL_SAMPLE_OFFSET into the queue. NULL if they were not measured.
+    const float * levels_at(ALint sample) {
+	for (unsigned int i = 0; i < queue_len; i++) {
+	    queued_chunk & c = queue[(queue_head + i) % NBUFFERS];
+	    if ((size_t)sample < c.frames) {
+		size_t at = sample / METER_FRAMES * 2 * channels;
+		return at < c.levels.size() ? &c.levels[at] : NULL;
+	    }
+	    sample -= c.frames;
+	}
+	return NULL;
+    }
+
+    // the frame the next chunk starts with
+    size_t next_frame() {
+	return (offset - data_start) / block_size * block_frames + skip;
+    }
+
+    // where the cost of convert() is accounted
+    Timing & timing() {
+	return enc >= MULAW ? stats.decode : stats.convert;
+    }
+    const void * convert(const void * in, size_t len, size_t & out_len);
+
+    // compressed files are kept small rather than resampled
+    bool needs_resampling() {
+	if (!resample_files || !device_rate || frequency == device_rate
+	    || enc >= MULAW)
+	    return false;
+	if (!Resampler::supported(frequency, device_rate)) {
+	    std::cerr << "Warning: can not resample '" << path << "' from "
+		      << frequency << " to " << device_rate << " Hz" << std::endl;
+	    return false;
+	}
+	// the length of the copy has to fit into its riff header
+	if (resampled_bytes() > 0xffffffffULL - 36) {
+	    std::cerr << "Warning: '" << path << "' is too long to be resampled"
+		      << std::endl;
+	    return false;
+	}
+	return true;
+    }
+
+    // bytes of samples in the resampled copy
+    uint64_t resampled_bytes() {
+	uint64_t n = (data_end - data_start) / block_size;
+	return (n * device_rate + frequency - 1) / frequency * channels
+	       * (al_float32 ? sizeof(float) : sizeof(int16_t));
+    }
+    std::string resampled();
+
+    // bytes of a frame as handed to OpenAL
+    unsigned int out_frame_size() {
+	if (direct) return block_size;
+	if (format == AL_FORMAT_MONO_FLOAT32 || format == AL_FORMAT_STEREO_FLOAT32)
+	    return channels * sizeof(float);
+	return channels * sizeof(int16_t);
+    }
+    size_t render(size_t from, size_t len, char * out);
+    void queue_chunk(Source & source, ALuint buffer, const char * out,
+		     size_t frames, size_t start, size_t wrap_at,
+		     size_t resume = 0, size_t period = 1);
+    void meter(queued_chunk & c, const char * out, size_t frames);
+    bool loop_range(Source & source, size_t & ls, size_t & le);
+    int feed_loop(Source & source, ALuint buffer, size_t len);
     int feed_one(Source & source, ALuint buffer, size_t len);
     int feed_start(Source & source);
     int feed_more(Source & source);
-
-    Buffer(const char * f) {
+    void prefetch(size_t from, size_t to);
+    void release(size_t from, size_t to);
+    void advise(Source & source);
+    void release_ahead();
+    void take_over(Buffer & old);
+    bool can_mix(Buffer & old);
+    void fade_from(Buffer * old, ALfloat seconds);
+    const char * crossfade(const char * in, size_t frames);
+    void end_fade();
+
+    Buffer(const char * f) : lazy(false) {
 	fromFile(f);
     }
 
-    Buffer(std::string & file) {
+    Buffer(std::string & file) : lazy(false) {
 	fromFile(file.c_str());
     }
 
-    Buffer(Json::Value & s) {
+    Buffer(std::string & file, bool _lazy) : lazy(false) {
+	if (_lazy)
+	    fromFileLazy(file.c_str());
+	else
+	    fromFile(file.c_str());
+    }
+
+    Buffer(Bank * b, const struct ss_bank_entry * e) : lazy(false) {
+	fromBank(b, e);
+    }
+
+    Buffer(Json::Value & s) : lazy(false) {
 	if (!s.isString())
 	    throw("Bad argument one to Buffer(). Expected string.");
 	fromFile(s.asCString());
@@ -324,40 +967,75 @@ public:
 #ifdef TESTING
 	std::cerr << "deleting buffer " << id << " with data " << data << std::endl;
 #endif
-	alDeleteBuffers(NBUFFERS, id);
-	munmap(data, st.st_size);
-	close(fd);
+	if (fading) end_fade();
+	unload();
     }
 
 };
 
+// keeps track of the lazy buffers which are currently loaded. when loading
+// another one would exceed the fd or mapping budget, the least recently
+// played sources which are idle are unloaded again.
+class BufferCache {
+    std::list<Source*> lru;
+
+    bool idle(Source * s);
+    bool evict(size_t need, bool source);
+public:
+    size_t max_open;
+    size_t max_mapped;
+    size_t open_files;
+    size_t mapped;
+    // AL sources, of which the device only has a few hundred. a lazy
+    // source only has one while its buffer is loaded.
+    size_t max_sources;
+    size_t sources;
+
+    BufferCache() : max_open(0), max_mapped(0), open_files(0), mapped(0),
+		    max_sources(0), sources(0) {}
+
+    void acquire(Source * s);
+    void adopt(Source * s);
+    void forget(Source * s);
+    void hold(Buffer * b);
+    void let_go(Buffer * b);
+};
+
+BufferCache buffer_cache;
+
 class SourceSettings {
     void get(ALenum pname, ALint & i) {
+	if (!id) return;
 	alGetSourcei(id, pname, & i);
 	checkError();
     }
 
     void get(ALenum pname, ALfloat & f) {
+	if (!id) return;
 	alGetSourcef(id, pname, & f);
 	checkError();
     }
 
     void get(ALenum pname, ALfloat f[]) {
+	if (!id) return;
 	alGetSourcefv(id, pname, f);
 	checkError();
     }
 
     void set(ALenum pname, ALint i) {
+	if (!id) return;
 	alSourcei(id, pname, i);
 	checkError();
     }
 
     void set(ALenum pname, ALfloat f) {
+	if (!id) return;
 	alSourcef(id, pname, f);
 	checkError();
     }
 
     void set(ALenum pname, ALfloat f[]) {
+	if (!id) return;
 	alSourcefv(id, pname, f);
 	checkError();
     }
@@ -373,7 +1051,13 @@ class SourceSettings {
 	b = (i == AL_TRUE);
     }
 public:
+    // 0 while a lazy source has no AL source. the settings are only kept
+    // in the values then, and applied when it gets one.
     ALuint id;
+    std::string name;
+    // unique for the life of the process, unlike the AL id which is
+    // reused once a source is deleted
+    unsigned long serial;
 #define FUN(name, FLAG)	typeof(name ## _value) name () {		    \
 	get(FLAG, name ## _value);					    \
 	return name ## _value;						    \
@@ -430,6 +1114,7 @@ public:
     fFUN(max_gain, AL_MAX_GAIN);
     iFUN(state, AL_SOURCE_STATE);
     iFUN(buffers_processed, AL_BUFFERS_PROCESSED);
+    iFUN(sample_offset, AL_SAMPLE_OFFSET);
 
     SourceSettings() {}
     SourceSettings(ALuint _id) : id(_id) {
@@ -455,12 +1140,16 @@ public:
     }
 
     void apply() {
-	position(position_value);
-	velocity(velocity_value);
-	pitch(pitch_value);
-	gain(gain_value);
-	min_gain(min_gain_value);
-	max_gain(max_gain_value);
+	apply(*this);
+    }
+
+    void apply(SourceSettings & s) {
+	s.position(position_value);
+	s.velocity(velocity_value);
+	s.pitch(pitch_value);
+	s.gain(gain_value);
+	s.min_gain(min_gain_value);
+	s.max_gain(max_gain_value);
     }
 };
 
@@ -470,6 +1159,11 @@ public:
     Buffer * buffer;
     Device * dev;
     bool is_copy;
+    unsigned long underruns;
+
+    // position in the BufferCache, if the buffer is lazy and loaded
+    bool cached;
+    std::list<Source*>::iterator cache_pos;
 
     bool _loop;
     bool loop() {
@@ -485,84 +1179,317 @@ public:
 	return _loop;
     }
 
+    // loop points in frames, a loop_end of 0 is the end of the file, and
+    // the crossfade at the seam in seconds
+    ALint loop_start_value, loop_end_value;
+    ALfloat loop_crossfade_value;
+
+    ALint loop_start() {
+	return loop_start_value;
+    }
+
+    ALint loop_start(ALint v) {
+	if (v < 0) throw("loop_start must not be negative");
+	return loop_start_value = v;
+    }
+
+    ALint loop_start(Json::Value & v) {
+	ALint i;
+	Json2AL(v, i);
+	return loop_start(i);
+    }
+
+    ALint loop_end() {
+	return loop_end_value;
+    }
+
+    ALint loop_end(ALint v) {
+	if (v < 0) throw("loop_end must not be negative");
+	return loop_end_value = v;
+    }
+
+    ALint loop_end(Json::Value & v) {
+	ALint i;
+	Json2AL(v, i);
+	return loop_end(i);
+    }
+
+    ALfloat loop_crossfade() {
+	return loop_crossfade_value;
+    }
+
+    ALfloat loop_crossfade(ALfloat v) {
+	if (v < 0.0f) throw("loop_crossfade must not be negative");
+	return loop_crossfade_value = v;
+    }
+
+    ALfloat loop_crossfade(Json::Value & v) {
+	ALfloat f;
+	Json2AL(v, f);
+	return loop_crossfade(f);
+    }
+
     void add(Buffer * buf) {
 	if (buffer) {
 	    std::cerr << "sources can currently only hold one buffer."
 			 " replacing old one." << std::endl;
+	    // the AL buffers must not be queued when they are deleted
+	    delete pending;
+	    pending = NULL;
+	    Stop();
+	    buffer_cache.forget(this);
 	    delete(buffer);
 	}
 	buffer = buf;
+	// a lazy source gets its AL source back when it is loaded
+	if (buf->lazy) detach();
+	else attach();
 #if 0
 	std::cerr << "adding buffer " << buf->id << std::endl;
 #endif
     }
 
+    // the buffer set_file switches to at the next refill, and how
+    Buffer * pending;
+    ALfloat pending_fade;
+    bool pending_sync;
+
+    // plays another file without stopping. a playing or paused source
+    // switches at a chunk boundary, while the rest of the queue plays.
+    void SetBuffer(Buffer * b, ALfloat fade, bool sync) {
+	delete pending;
+	pending = NULL;
+	if (buffer && (paused || state() == AL_PLAYING)) {
+	    pending = b;
+	    pending_fade = fade;
+	    pending_sync = sync;
+	    // the kernel reads the start while the old file plays on
+	    if (b->loaded()) b->prefetch(b->offset, b->offset + NBUFFERS * b->chunk_size);
+	} else if (buffer) {
+	    Stop();
+	    replace(b, true);
+	} else {
+	    buffer = b;
+	}
+    }
+
+    // puts b in place of the buffer, and takes over its place in the cache
+    // if it was lazy
+    void replace(Buffer * b, bool delete_old) {
+	Buffer * old = buffer;
+	bool lazy = old->lazy, counted = cached;
+
+	buffer_cache.forget(this);
+	buffer = b;
+	if (lazy && !b->lazy && !b->bank) {
+	    b->lazy = true;
+	    if (b->loaded()) buffer_cache.adopt(this);
+	    else detach();
+	}
+	if (delete_old) delete old;
+	else if (counted) buffer_cache.hold(old);
+	notify(NOTIFY_FILE_SWITCHED, name);
+    }
+
+    // the old chunks stay queued and the new ones follow them. with sync
+    // the new file starts at the time the old one was going to play next.
+    void switch_buffer() {
+	Buffer * old = buffer;
+	Buffer * b = pending;
+	pending = NULL;
+
+	if (pending_sync)
+	    b->seek((size_t)((double)old->next_frame() * b->frequency / old->frequency));
+	b->take_over(*old);
+	if (pending_fade > 0.0f && b->can_mix(*old)) {
+	    replace(b, false);
+	    b->fade_from(old, pending_fade);
+	} else {
+	    replace(b, true);
+	}
+    }
+
     bool paused;
+    // prepared and waiting for a StartCue. the refill timer is not armed
+    // until then: a stopped AL source counts its whole queue as processed,
+    // which would look like an underrun and start it early.
+    bool cued;
 
-    void Play() {
-	if (!buffer) return;
+    // fill the queue without starting the AL source, so that several
+    // sources can be started at once. a cued source is left for
+    // Started() to set going.
+    bool Prepare(bool cue = false) {
+	if (!buffer) return false;
+
+	buffer_cache.acquire(this);
 
 	if (paused) {
 	    paused = false;
-	    timer_continue();
+	    if (!cue) timer_continue();
 	} else {
+	    // a seek while stopped says where to start
+	    long frame = seek_frame;
 	    Stop();
-	    timer_start();
+	    if (frame >= 0) buffer->seek(frame);
+	    if (cue)
+		buffer->feed_start(*this);
+	    else
+		timer_start();
 	}
-	alSourcePlay(id);
+	cued = cue;
+	return true;
+    }
+
+    // the AL source of a cued source was started
+    void Started() {
+	cued = false;
+	if (buffer) timer_continue();
+    }
+
+    void Play() {
+	if (Prepare()) alSourcePlay(id);
     }
 
     void Stop() {
+	if (!buffer) return;
+	if (id) alSourceStop(id);
+	Stopped();
+    }
+
+    // clean up after the AL source has been stopped
+    void Stopped() {
 	if (!buffer) return;
 	timer_stop();
 	buffer->reset();
-	alSourceStop(id);
+	buffer->release_ahead();
 	paused = false;
+	cued = false;
+	seek_frame = -1;
 
 	ALuint num = buffers_processed();
 
 	while (num--) unqueue_buffer();
+
+	// nothing is playing, so a pending file can take over right away
+	if (pending) {
+	    Buffer * b = pending;
+	    pending = NULL;
+	    replace(b, true);
+	}
     }
 
     void Rewind() {
-	// TODO: this is certainly broken
+	Seek((size_t)0);
+    }
+
+    // the next frame to play. a playing or paused source drops its queue
+    // and refills it from there, a stopped one starts there when played.
+    long seek_frame;
+
+    void Seek(size_t frame) {
 	if (!buffer) return;
-	buffer->reset();
-	alSourceRewind(id);
-	paused = false;
+	buffer_cache.acquire(this);
+	if (!paused && state() != AL_PLAYING) {
+	    seek_frame = frame < buffer->frames() ? frame : buffer->frames();
+	    return;
+	}
+
+	bool playing = !paused;
+	alSourceStop(id);
+	timer_stop();
+	ALuint num = buffers_processed();
+	while (num--) unqueue_buffer();
+	buffer->seek(frame);
+	if (playing) {
+	    timer_start();
+	    alSourcePlay(id);
+	} else {
+	    // continued by Prepare(), which only restarts the timer
+	    buffer->feed_start(*this);
+	}
+    }
+
+    void Seek(double time) {
+	if (!buffer) return;
+	buffer_cache.acquire(this);
+	Seek(time > 0.0 ? (size_t)llround(time * buffer->frequency) : (size_t)0);
     }
 
     void Pause() {
 	paused = true;
+	cued = false;
 	timer_stop();
-	alSourcePause(id);
+	if (id) alSourcePause(id);
     }
 
     Source(Device * _dev) : dev(_dev) {
+	static unsigned long serials = 0;
+	serial = ++serials;
 	buffer = NULL;
 	paused = false;
 	timer_set = false;
-	alGenSources(1, &id);
+	cached = false;
+	underruns = 0;
+	_loop = false;
+	loop_start_value = loop_end_value = 0;
+	loop_crossfade_value = 0.0f;
+	seek_frame = -1;
+	pending = NULL;
+	cued = false;
+	id = 0;
+	position(0.0f, 0.0f, 0.0f);
+	velocity(0.0f, 0.0f, 0.0f);
+	pitch_value = gain_value = max_gain_value = 1.0f;
+	min_gain_value = 0.0f;
+	state_value = AL_INITIAL;
+	buffers_processed_value = sample_offset_value = 0;
 	evtimer_set(&timer_ev, timer_callback, this);
+    }
+
+    // gets an AL source and applies the settings to it
+    void attach() {
+	if (id) return;
+	alGenSources(1, &id);
+	checkError();
+	buffer_cache.sources++;
 #ifdef TESTING
 	std::cerr << "created source " << id << std::endl;
 #endif
+	apply();
+    }
+
+    // gives the AL source back. it must be stopped.
+    void detach() {
+	if (!id) return;
 	update();
+	alDeleteSources(1, &id);
+	buffer_cache.sources--;
+#ifdef TESTING
+	std::cerr << "deleted source " << id << std::endl;
+#endif
+	id = 0;
+	state_value = AL_INITIAL;
+	buffers_processed_value = sample_offset_value = 0;
     }
 
     SourceSettings * copy() {
-	SourceSettings * t = new SourceSettings(id);
-	return t;
+	update();
+	return new SourceSettings(*this);
     }
     
     ~Source() {
 #ifdef TESTING
 	std::cerr << ">> deletint source " << id << std::endl;
 #endif
+	delete pending;
+	pending = NULL;
 	Stop();
-	if (buffer) delete(buffer);
-	alDeleteSources(1, &id);
-#ifdef TESTING
+	if (buffer) {
+	    buffer_cache.forget(this);
+	    delete(buffer);
+	}
+	detach();
+#ifdef TESTING
 	std::cerr << "<< deleted source " << id << std::endl;
 #endif
     }
@@ -574,9 +1501,30 @@ public:
     ALuint unqueue_buffer() {
 	ALuint buf_id;
 	alSourceUnqueueBuffers(id, 1, &buf_id);
+	if (buffer) buffer->chunk_done();
 	return buf_id;
     }
 
+    // the frame of the file which is audible right now
+    size_t play_frame() {
+	if (!buffer || !buffer->loaded()) return 0;
+	if (seek_frame >= 0) return seek_frame;
+	return buffer->play_frame(sample_offset());
+    }
+
+    // the same in seconds
+    double play_offset() {
+	if (!buffer || !buffer->loaded()) return 0.0;
+	return (double)play_frame() / buffer->frequency;
+    }
+
+    // the peak and rms of each channel which are audible right now, NULL
+    // unless playing
+    const float * levels() {
+	if (!buffer || !buffer->loaded() || state() != AL_PLAYING) return NULL;
+	return buffer->levels_at(sample_offset());
+    }
+
     bool timer_set;
 
     void timer_continue() {
@@ -601,11 +1549,34 @@ public:
 
     void run() {
 	timer_set = false;
-	if (buffer && buffer->feed_more(*this)) {
+	if (!buffer) return;
+
+	bool more;
+	{
+	    Timed t(stats.refill);
+	    Faulted f;
+	    if (pending && buffers_processed()) switch_buffer();
+	    more = buffer->feed_more(*this);
+	}
+	if (more) {
 	    timer_continue();
+	} else if (state() == AL_PLAYING) {
+	    // the stream is done, but the queue is still playing
+	    timer_continue();
+	} else {
+	    notify(NOTIFY_SOURCE_ENDED, name);
 	}
     }
 
+    // the queue ran dry before it was refilled
+    void underrun() {
+	underruns++;
+	stats.underruns++;
+	std::cerr << "underrun in '" << name << "'" << std::endl;
+	notify(NOTIFY_UNDERRUN, name);
+	alSourcePlay(id);
+    }
+
     static void timer_callback(int, short int, void * o) {
 	try {
 	    ((Source*)o)->run();
@@ -618,39 +1589,706 @@ public:
 
 };
 
+bool BufferCache::idle(Source * s) {
+    if (s->paused || s->cued) return false;
+    ALint state = s->state();
+    return state != AL_PLAYING && state != AL_PAUSED;
+}
+
+// unload idle buffers from the back of the lru until another buffer of
+// size need, and another AL source if asked, fit into the budget.
+bool BufferCache::evict(size_t need, bool source) {
+    std::list<Source*>::iterator it = lru.end();
+
+    while ((max_open && open_files + 1 > max_open)
+	   || (max_mapped && mapped + need > max_mapped)
+	   || (source && max_sources && sources + 1 > max_sources)) {
+	do {
+	    if (it == lru.begin()) return false;
+	    it--;
+	} while (!idle(*it));
+
+	Source * s = *it;
+	it = lru.erase(it);
+	s->cached = false;
+	s->Stop();
+	open_files--;
+	mapped -= s->buffer->st.st_size;
+	s->buffer->unload();
+	s->detach();
+    }
+    return true;
+}
+
+void BufferCache::acquire(Source * s) {
+    Buffer * b = s->buffer;
+
+    if (!b->lazy) {
+	s->attach();
+	return;
+    }
+
+    if (s->cached) {
+	lru.splice(lru.begin(), lru, s->cache_pos);
+	return;
+    }
+
+    if (!evict(b->st.st_size, !s->id)) {
+	std::cerr << "warning: all " << open_files << " loaded buffers are "
+		  << "playing. exceeding buffer budget." << std::endl;
+    }
+
+    b->load();
+    s->attach();
+    adopt(s);
+}
+
+// accounts for a lazy buffer which was loaded already
+void BufferCache::adopt(Source * s) {
+    open_files++;
+    mapped += s->buffer->st.st_size;
+    lru.push_front(s);
+    s->cache_pos = lru.begin();
+    s->cached = true;
+}
+
+void BufferCache::forget(Source * s) {
+    if (!s->cached) return;
+    lru.erase(s->cache_pos);
+    s->cached = false;
+    open_files--;
+    mapped -= s->buffer->st.st_size;
+}
+
+// a buffer which was replaced but fades out under its successor keeps its
+// fd and mapping, so it stays in the budget until the fade is over. it
+// can not be evicted meanwhile.
+void BufferCache::hold(Buffer * b) {
+    open_files++;
+    mapped += b->st.st_size;
+    b->held = true;
+}
+
+void BufferCache::let_go(Buffer * b) {
+    if (!b->held) return;
+    open_files--;
+    mapped -= b->st.st_size;
+    b->held = false;
+}
+
+// converts or decodes len bytes of samples for OpenAL into convert_buf
+const void * Buffer::convert(const void * in, size_t len, size_t & out_len) {
+    size_t n = enc == IMA_ADPCM ? len / block_size * block_frames * channels
+				: len / sample_size;
+    bool to_float = format == AL_FORMAT_MONO_FLOAT32
+		    || format == AL_FORMAT_STEREO_FLOAT32;
+    Timed t(timing());
+
+    out_len = n * (to_float ? sizeof(float) : sizeof(int16_t));
+    if (convert_buf.size() < out_len) convert_buf.resize(out_len);
+    void * out = &convert_buf[0];
+
+    switch (enc) {
+    case PCM_S24:
+	if (to_float) pcm_s24_to_f32(in, (float*)out, n);
+	else pcm_s24_to_s16(in, (int16_t*)out, n);
+	break;
+    case PCM_S32:
+	if (to_float) pcm_s32_to_f32(in, (float*)out, n);
+	else pcm_s32_to_s16(in, (int16_t*)out, n);
+	break;
+    case PCM_F32:
+	pcm_f32_to_s16(in, (int16_t*)out, n);
+	break;
+    case MULAW:
+	pcm_mulaw_to_s16(in, (int16_t*)out, n);
+	break;
+    case IMA_ADPCM:
+	pcm_ima_to_s16(in, (int16_t*)out, len / block_size, block_size, channels);
+	break;
+    default:
+	throw("no conversion for this format");
+    }
+    if (enc >= MULAW) stats.decode_bytes += len;
+    else stats.convert_bytes += len;
+    return out;
+}
+
+/*
+ * Writes the copies of files resampled to the device rate, a block at a
+ * time from a timer, so that resampling a long file does not hold up the
+ * event loop. Each job maps the file on its own, since the buffer which
+ * asked for it may be unloaded meanwhile.
+ */
+class ResampleQueue {
+    // frames resampled per step
+    static const size_t BLOCK = 16384;
+
+    struct Job {
+	std::string path, name, tmp;
+	int fd;
+	void * data;
+	size_t size, data_start, block_size, frames, done;
+	unsigned int channels;
+	void (*to_float)(const void *, float *, size_t);
+	Resampler * r;
+	FILE * out;
+
+	Job() : fd(-1), data(NULL), r(NULL), out(NULL) {}
+
+	~Job() {
+	    if (out) {
+		fclose(out);
+		unlink(tmp.c_str());
+	    }
+	    delete r;
+	    if (data) munmap(data, size);
+	    if (fd != -1) close(fd);
+	}
+    };
+
+    std::list<Job*> jobs;
+    std::vector<float> in, res;
+    std::vector<int16_t> s16;
+    struct event timer_ev;
+    bool timer_set;
+
+    void timer_continue() {
+	const struct timeval t = { 0, 1000 };
+	if (!timer_set && !jobs.empty()) {
+	    evtimer_add(&timer_ev, &t);
+	    timer_set = true;
+	}
+    }
+
+    // resamples the next block of j, returns false when it is done
+    bool step(Job * j) {
+	Timed t(stats.resample);
+	size_t n = j->frames - j->done;
+	if (n > BLOCK) n = BLOCK;
+
+	res.clear();
+	if (n) {
+	    in.resize(n * j->channels);
+	    j->to_float((char*)j->data + j->data_start + j->done * j->block_size,
+			&in[0], n * j->channels);
+	    j->r->process(&in[0], n, res);
+	    j->done += n;
+	} else {
+	    j->r->flush(res);
+	}
+	if (!res.empty()) {
+	    bool ok;
+	    if (al_float32) {
+		ok = fwrite(&res[0], sizeof(float), res.size(), j->out) == res.size();
+	    } else {
+		s16.resize(res.size());
+		pcm_f32_to_s16(&res[0], &s16[0], res.size());
+		ok = fwrite(&s16[0], sizeof(int16_t), s16.size(), j->out) == s16.size();
+	    }
+	    if (!ok) throw("could not write resampled file");
+	}
+	return n;
+    }
+
+    void finish(Job * j) {
+	FILE * out = j->out;
+	j->out = NULL;
+	if (fclose(out) || rename(j->tmp.c_str(), j->name.c_str())) {
+	    unlink(j->tmp.c_str());
+	    throw("could not write resampled file");
+	}
+	std::cerr << "resampled '" << j->path << "' to " << device_rate
+		  << " Hz in " << j->name << std::endl;
+    }
+
+    static void timer_cb(int, short, void * o) {
+	ResampleQueue * self = (ResampleQueue*)o;
+	Job * j = self->jobs.front();
+	self->timer_set = false;
+	try {
+	    if (!self->step(j)) {
+		self->finish(j);
+		self->jobs.pop_front();
+		delete j;
+	    }
+	} catch (const char * e) {
+	    std::cerr << "error resampling '" << j->path << "': " << e << std::endl;
+	    self->jobs.pop_front();
+	    delete j;
+	}
+	self->timer_continue();
+    }
+
+public:
+    ResampleQueue() : timer_set(false) {}
+
+    // whether the copy name is being written
+    bool pending(const std::string & name) {
+	std::list<Job*>::iterator it;
+	for (it = jobs.begin(); it != jobs.end(); it++) {
+	    if ((*it)->name == name) return true;
+	}
+	return false;
+    }
+
+    void add(Buffer & b, const std::string & name);
+};
+
+ResampleQueue resample_queue;
+
+void ResampleQueue::add(Buffer & b, const std::string & name) {
+    void (*to_float)(const void *, float *, size_t);
+    struct stat st;
+
+    if (pending(name)) return;
+
+    switch (b.enc) {
+    case Buffer::PCM_U8: to_float = pcm_u8_to_f32; break;
+    case Buffer::PCM_S16: to_float = pcm_s16_to_f32; break;
+    case Buffer::PCM_S24: to_float = pcm_s24_to_f32; break;
+    case Buffer::PCM_S32: to_float = pcm_s32_to_f32; break;
+    case Buffer::PCM_F32: to_float = pcm_f32_to_f32; break;
+    default: throw("can not resample this format");
+    }
+
+    Job * j = new Job();
+    try {
+	j->path = b.path;
+	j->name = name;
+	j->fd = open(b.path.c_str(), O_RDONLY);
+	if (j->fd == -1 || fstat(j->fd, &st) == -1)
+	    throw("could not open file");
+	// the offsets are those of the file the buffer parsed
+	if (st.st_size != b.st.st_size || st.st_mtime != b.st.st_mtime)
+	    throw("file changed");
+	j->size = st.st_size;
+	j->data = mmap(0, j->size, PROT_READ, MAP_SHARED, j->fd, 0);
+	if (j->data == MAP_FAILED) {
+	    j->data = NULL;
+	    throw("mmap failed");
+	}
+	madvise(j->data, j->size, MADV_SEQUENTIAL);
+	j->data_start = b.data_start;
+	j->block_size = b.block_size;
+	j->frames = (b.data_end - b.data_start) / b.block_size;
+	j->done = 0;
+	j->channels = b.channels;
+	j->to_float = to_float;
+	j->r = new Resampler(b.frequency, device_rate, b.channels);
+
+	unsigned int out_sample = al_float32 ? sizeof(float) : sizeof(int16_t);
+	unsigned int length = (unsigned int)b.resampled_bytes();
+	struct {
+	    char riff[4];
+	    unsigned int riff_length;
+	    char wave[4];
+	    char fmt[4];
+	    unsigned int fmt_length;
+	    unsigned short tag, channels;
+	    unsigned int sample_rate, bytes_per_second;
+	    unsigned short align, bits_per_sample;
+	    char data[4];
+	    unsigned int data_length;
+	} __attribute__((packed)) h = {
+	    {'R','I','F','F'}, 36 + length, {'W','A','V','E'}, {'f','m','t',' '}, 16,
+	    (unsigned short)(al_float32 ? Buffer::WAVE_FORMAT_IEEE_FLOAT
+					: Buffer::WAVE_FORMAT_PCM),
+	    (unsigned short)b.channels, device_rate, device_rate * b.channels * out_sample,
+	    (unsigned short)(b.channels * out_sample), (unsigned short)(out_sample * 8),
+	    {'d','a','t','a'}, length
+	};
+
+	mkdir(resample_cache.c_str(), 0755);
+	// written under another name first, so no one sees half a file
+	std::ostringstream tmp;
+	tmp << name << '.' << getpid();
+	j->tmp = tmp.str();
+	j->out = fopen(j->tmp.c_str(), "wb");
+	if (!j->out)
+	    throw("could not create resampled file");
+	if (fwrite(&h, sizeof(h), 1, j->out) != 1)
+	    throw("could not write resampled file");
+    } catch (const char * e) {
+	std::cerr << "error resampling '" << b.path << "': " << e << std::endl;
+	delete j;
+	return;
+    }
+
+    jobs.push_back(j);
+    if (!timer_set) evtimer_set(&timer_ev, timer_cb, this);
+    timer_continue();
+}
+
+// the copy of the file resampled to the device rate, as float if OpenAL
+// takes it, or "" until it is written. the copy is written to the cache
+// once and used by every source loading the file from then on, until the
+// file changes.
+std::string Buffer::resampled() {
+    std::ostringstream key, name;
+    std::string base = path.substr(path.rfind('/') + 1);
+    struct stat cs;
+
+    key << path << ' ' << st.st_size << ' ' << st.st_mtime << ' '
+	<< device_rate << ' ' << al_float32;
+    name << resample_cache << '/' << base << '.' << std::hex
+	 << std::hash<std::string>()(key.str()) << ".wav";
+    if (stat(name.str().c_str(), &cs) == 0) return name.str();
+
+    resample_queue.add(*this, name.str());
+    return "";
+}
+
 int Buffer::feed_one(Source & source, ALuint buffer, size_t len) {
 
+    if (source.loop()) return feed_loop(source, buffer, len);
+
     if (!left()) return 0;
 
     if (left() < len) len = left();
+    // a truncated last frame (or block) is not played
+    len -= len % block_size;
+    if (!len) {
+	offset = data_end;
+	return 0;
+    }
 
-    alBufferData(buffer, format, buf(), len, frequency);
+    const void * out = buf();
+    size_t frames = len / block_size * block_frames;
+    if (!direct) {
+	size_t out_len;
+	out = convert(buf(), len, out_len);
+	// the refill has to be done well within its interval
+	if (!warned_slow && timing().last > interval * 1000.0 / 4) {
+	    std::cerr << "Warning: converting '" << path << "' takes "
+		      << timing().last << " us per chunk" << std::endl;
+	    warned_slow = true;
+	}
+    }
+    queue_chunk(source, buffer, (const char *)out, frames,
+		(offset - data_start) / block_size * block_frames, frames);
     offset += len;
 
+    return 1;
+}
+
+// hands a chunk of samples to OpenAL and queues it on the source. after a
+// seek into the middle of an ADPCM block the frames before it are cut off.
+void Buffer::queue_chunk(Source & source, ALuint buffer, const char * out,
+			 size_t frames, size_t start, size_t wrap_at,
+			 size_t resume, size_t period) {
+    if (skip && skip < frames) {
+	out += skip * out_frame_size();
+	frames -= skip;
+	start += skip;
+	wrap_at = wrap_at > skip ? wrap_at - skip : 0;
+    }
+    skip = 0;
+    if (fading) out = crossfade(out, frames);
+    alBufferData(buffer, format, out, frames * out_frame_size(), frequency);
+    meter(chunk_queued(start, frames, wrap_at, resume, period), out, frames);
     source.enqueue_buffer(buffer);
+}
+
+// measures the levels of a chunk as OpenAL got it, so they are those of
+// what is heard, crossfades and all
+void Buffer::meter(queued_chunk & c, const char * out, size_t frames) {
+    static std::vector<float> sum_squares;
+
+    if (!metering) {
+	c.levels.clear();
+	return;
+    }
+
+    Timed t(stats.meter);
+    size_t blocks = (frames + METER_FRAMES - 1) / METER_FRAMES;
+    unsigned int size = out_frame_size();
+    c.levels.resize(blocks * 2 * channels);
+    sum_squares.resize(channels);
+    for (size_t b = 0; b < blocks; b++) {
+	size_t n = b + 1 < blocks ? METER_FRAMES : frames - b * METER_FRAMES;
+	const char * in = out + b * METER_FRAMES * size;
+	float * peak = &c.levels[b * 2 * channels];
+	switch (format) {
+	case AL_FORMAT_MONO8: case AL_FORMAT_STEREO8:
+	    pcm_levels_u8(in, n, channels, peak, &sum_squares[0]);
+	    break;
+	case AL_FORMAT_MONO_FLOAT32: case AL_FORMAT_STEREO_FLOAT32:
+	    pcm_levels_f32(in, n, channels, peak, &sum_squares[0]);
+	    break;
+	default:
+	    pcm_levels_s16(in, n, channels, peak, &sum_squares[0]);
+	}
+	// peaks come out packed, spread them to peak, rms pairs
+	for (unsigned int ch = channels; ch-- > 0; ) {
+	    peak[2 * ch] = peak[ch];
+	    peak[2 * ch + 1] = sqrtf(sum_squares[ch] / n);
+	}
+    }
+}
+
+// the samples of len bytes from the file offset from, as OpenAL takes them.
+// returns the bytes written to out.
+size_t Buffer::render(size_t from, size_t len, char * out) {
+    if (direct) {
+	memcpy(out, (char*)data + from, len);
+	return len;
+    }
+    size_t out_len;
+    const void * c = convert((char*)data + from, len, out_len);
+    memcpy(out, c, out_len);
+    return out_len;
+}
+
+// mixes head into tail with equal power, frames of the fade of len frames
+// starting at pos
+static void loop_mix(void * tail, const void * head, size_t frames,
+		     unsigned int channels, size_t pos, size_t len, ALenum format) {
+    for (size_t i = 0; i < frames; i++) {
+	float x = (pos + i + 0.5f) / len * (float)M_PI_2;
+	float gh = sinf(x), gt = cosf(x);
+	for (size_t k = i * channels; k < (i + 1) * channels; k++) {
+	    switch (format) {
+	    case AL_FORMAT_MONO8: case AL_FORMAT_STEREO8: {
+		unsigned char * t = (unsigned char *)tail;
+		const unsigned char * h = (const unsigned char *)head;
+		t[k] = (unsigned char)lrintf((t[k] - 128) * gt + (h[k] - 128) * gh + 128);
+		break;
+	    }
+	    case AL_FORMAT_MONO_FLOAT32: case AL_FORMAT_STEREO_FLOAT32:
+		((float *)tail)[k] = ((float *)tail)[k] * gt + ((const float *)head)[k] * gh;
+		break;
+	    default: {
+		float v = ((int16_t *)tail)[k] * gt + ((const int16_t *)head)[k] * gh;
+		((int16_t *)tail)[k] = v > 32767.0f ? 32767 : v < -32768.0f ? -32768 : (int16_t)lrintf(v);
+	    }
+	    }
+	}
+    }
+}
+
+// the loop of a source as file offsets, false if there is nothing to loop
+bool Buffer::loop_range(Source & source, size_t & ls, size_t & le) {
+    size_t end = data_end - (data_end - data_start) % block_size;
+
+    ls = data_start + source.loop_start() / block_frames * block_size;
+    le = data_start + source.loop_end() / block_frames * block_size;
+    if (!source.loop_end() || le > end) le = end;
+    if (ls >= le) ls = data_start;
+    return ls < le;
+}
+
+// fills a whole chunk of a looping source, wrapping from the loop end (or
+// the end of the file, if the source is past it) to the loop start. with a
+// crossfade the end of the loop fades into its start, which is then skipped.
+int Buffer::feed_loop(Source & source, ALuint buffer, size_t len) {
+    size_t frames = len / block_size * block_frames;
+    size_t frame_bytes = out_frame_size();
+    size_t end = data_end - (data_end - data_start) % block_size;
+    size_t ls, le;
+    size_t fade, fade_start, period, start, wrap_at = frames, done = 0;
+
+    if (!loop_range(source, ls, le)) return 0;
+    fade = (size_t)(source.loop_crossfade() * frequency) / block_frames * block_size;
+    if (fade > (le - ls) / 2) fade = (le - ls) / 2 / block_size * block_size;
+    fade_start = le - fade;
+    period = (le - ls - fade) / block_size * block_frames;
+
+    // a chunk may start in the middle of the fade, which plays as the start
+    if (offset > fade_start && offset < le)
+	start = ls + (offset - fade_start);
+    else
+	start = offset;
+    start = (start - data_start) / block_size * block_frames;
+
+    if (splice_buf.size() < frames * frame_bytes)
+	splice_buf.resize(frames * frame_bytes);
+
+    while (done < frames) {
+	size_t room = (frames - done) / block_frames * block_size;
+	size_t stop = offset < le ? le : end;
+	size_t take = 0;
+	char * out = &splice_buf[done * frame_bytes];
+
+	if (stop == le && offset >= fade_start && offset < le) {
+	    // the end of the loop fading into its start
+	    size_t head = ls + (offset - fade_start);
+	    take = std::min(le - offset, room);
+	    if (offset == fade_start && wrap_at == frames) wrap_at = done;
+	    render(offset, take, out);
+	    if (splice_head.size() < take / block_size * block_frames * frame_bytes)
+		splice_head.resize(take / block_size * block_frames * frame_bytes);
+	    render(head, take, &splice_head[0]);
+	    loop_mix(out, &splice_head[0], take / block_size * block_frames,
+		     channels, (offset - fade_start) / block_size * block_frames,
+		     fade / block_size * block_frames, format);
+	} else if (offset < stop) {
+	    take = std::min((stop == le ? fade_start : stop) - offset, room);
+	    render(offset, take, out);
+	}
+	offset += take;
+	done += take / block_size * block_frames;
+
+	if (offset >= stop) {
+	    if ((stop != le || !fade) && wrap_at == frames) wrap_at = done;
+	    offset = stop == le ? ls + fade : ls;
+	    notify(NOTIFY_LOOP_WRAPPED, source.name);
+	}
+    }
+
+    queue_chunk(source, buffer, &splice_buf[0], frames, start, wrap_at,
+		(ls - data_start) / block_size * block_frames, period);
 
     return 1;
 }
 
 int Buffer::feed_start(Source & source) {
     feed_one(source, id[0], chunk_size);
-    if (!left() && source.loop()) reset();
-    return feed_one(source, id[1], chunk_size);
+    int more = feed_one(source, id[1], chunk_size);
+    advise(source);
+    return more;
 }
 
 int Buffer::feed_more(Source & source) {
     ALuint num = source.buffers_processed();
+    bool starved = num == NBUFFERS && source.state() == AL_STOPPED
+		   && !source.cued;
 #ifdef TESTING
     std::cerr << "feeding " << num << " chunks" << std::endl;
 #endif
     while (num--) {
-	if (!left() && source.loop()) reset();
-	if (!feed_one(source, source.unqueue_buffer(), chunk_size)) return 0;
+	if (!feed_one(source, source.unqueue_buffer(), chunk_size)) {
+	    advise(source);
+	    return 0;
+	}
     }
+    advise(source);
+
+    if (starved) source.underrun();
 
     return 1;
 }
 
+void Buffer::prefetch(size_t from, size_t to) {
+    if (to <= from) return;
+    madvise((char*)data + from, to - from, MADV_WILLNEED);
+    stats.prefetched += to - from;
+}
+
+// the pages were handed to OpenAL already. with a budget they leave the
+// page cache too, unless someone else has them mapped.
+void Buffer::release(size_t from, size_t to) {
+    if (to <= from) return;
+    madvise((char*)data + from, to - from, MADV_DONTNEED);
+    if (residency.budget)
+	posix_fadvise(fd, from, to - from, POSIX_FADV_DONTNEED);
+    stats.released += to - from;
+}
+
+// moves the window of pages in memory along with the read offset: the next
+// chunks are read ahead, so the refill does not wait for the disk, and the
+// pages behind are let go. a looping source also reads ahead across the
+// seam.
+void Buffer::advise(Source & source) {
+    if (!loaded()) return;
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    size_t ahead = chunk_size * (residency.budget && residency.resident
+				 > residency.budget ? 1 : residency.readahead);
+    size_t from = offset / page * page;
+    size_t to = std::min((offset + ahead + page - 1) / page * page,
+			 (size_t)st.st_size);
+    size_t ls, le;
+
+    if (offset >= data_end) from = to = 0;
+
+    // what is no longer in the window, then what is new in it
+    release(ahead_from, std::min(ahead_to, from));
+    release(std::max(ahead_from, to), ahead_to);
+    prefetch(from, std::min(to, ahead_from));
+    prefetch(std::max(from, ahead_to), to);
+
+    residency.resident += (to - from) - (ahead_to - ahead_from);
+    ahead_from = from;
+    ahead_to = to;
+
+    if (source.loop() && offset < data_end && loop_range(source, ls, le)
+	&& offset + ahead > le) {
+	from = ls / page * page;
+	prefetch(from, std::min(ls + (offset + ahead - le), le));
+    }
+}
+
+// a stopped source keeps nothing in memory
+void Buffer::release_ahead() {
+    if (!loaded()) return;
+    release(ahead_from, ahead_to);
+    residency.resident -= ahead_to - ahead_from;
+    ahead_from = ahead_to = 0;
+}
+
+// takes the place of old on its source. the chunks of old which are still
+// queued play on, so the AL buffers change owners and the queue is kept.
+void Buffer::take_over(Buffer & old) {
+    for (int i = 0; i < NBUFFERS; i++) std::swap(id[i], old.id[i]);
+    for (int i = 0; i < NBUFFERS; i++) std::swap(queue[i], old.queue[i]);
+    queue_head = old.queue_head;
+    queue_len = old.queue_len;
+}
+
+// whether old can be mixed into this buffer as it is handed to OpenAL
+bool Buffer::can_mix(Buffer & old) {
+    return old.loaded() && old.format == format && old.frequency == frequency;
+}
+
+void Buffer::fade_from(Buffer * old, ALfloat seconds) {
+    if (fading) end_fade();
+    fading = old;
+    fade_frames = (size_t)(seconds * frequency);
+    fade_done = 0;
+    fade_src = old->next_frame();
+    if (!fade_frames) end_fade();
+}
+
+// the replaced buffer is done with
+void Buffer::end_fade() {
+    buffer_cache.let_go(fading);
+    delete fading;
+    fading = NULL;
+}
+
+// mixes what the replaced buffer was going to play next into the start of
+// this one, with the curve of the loop crossfade. silence where it ends.
+const char * Buffer::crossfade(const char * in, size_t frames) {
+    Buffer * old = fading;
+    size_t fb = out_frame_size();
+    size_t n = std::min(frames, fade_frames - fade_done);
+    size_t first = fade_src / old->block_frames;
+    size_t last = (fade_src + n + old->block_frames - 1) / old->block_frames;
+    size_t from = old->data_start + first * old->block_size;
+    size_t len = 0, tail_bytes = (last - first) * old->block_frames * fb;
+
+    if (from < old->data_end)
+	len = std::min((last - first) * old->block_size, old->data_end - from);
+    len -= len % old->block_size;
+
+    // in may be convert_buf, which rendering the old samples overwrites
+    if (fade_buf.size() < frames * fb) fade_buf.resize(frames * fb);
+    memcpy(&fade_buf[0], in, frames * fb);
+    if (fade_tail.size() < tail_bytes) fade_tail.resize(tail_bytes);
+    memset(&fade_tail[0], format == AL_FORMAT_MONO8 || format == AL_FORMAT_STEREO8
+			  ? 128 : 0, tail_bytes);
+    if (len) old->render(from, len, &fade_tail[0]);
+
+    char * tail = &fade_tail[(fade_src % old->block_frames) * fb];
+    loop_mix(tail, &fade_buf[0], n, channels, fade_done, fade_frames, format);
+    memcpy(&fade_buf[0], tail, n * fb);
+
+    fade_src += n;
+    fade_done += n;
+    if (fade_done >= fade_frames) end_fade();
+    return &fade_buf[0];
+}
+
 class Animation {
 public:
     struct timespec start, end, now;
@@ -799,6 +2437,7 @@ public:
     }
 
     void run() {
+	Timed t(stats.animator);
 	std::list<Animation*>::iterator it;
 	for (it = l.begin(); it != l.end();) {
 	    Animation * a = * it;
@@ -808,6 +2447,7 @@ public:
 
 	    if (a->done()) {
 		it = l.erase(it);
+		notify(NOTIFY_ANIMATION_DONE, a->source->name, a->toString());
 		delete a;
 		continue;
 	    }
@@ -861,6 +2501,164 @@ public:
     }
 };
 
+// a cue is something which has to happen at a given time. cues with the
+// same due time run in the order they were added.
+class Cue {
+public:
+    struct timespec due;
+    unsigned long seq;
+
+    Cue(double delay) {
+	clock_gettime(CLOCK_MONOTONIC, &due);
+	if (delay > 0.0) {
+	    long nsec = due.tv_nsec + (long)((delay-(double)(long)delay) * 1E9);
+	    due.tv_sec += (time_t)delay + nsec / 1000000000L;
+	    due.tv_nsec = nsec % 1000000000L;
+	}
+    }
+
+    virtual ~Cue() { }
+
+    virtual const char * toString() {
+	return "Cue";
+    }
+
+    virtual void fire() { }
+};
+
+class CommandCue : public Cue {
+    Json::Value cmd;
+public:
+    CommandCue(double delay, Json::Value & _cmd) : Cue(delay), cmd(_cmd) {
+	cmd.removeMember("at");
+	cmd.removeMember("delay");
+    }
+
+    void fire() {
+	interpol_callback(cmd);
+    }
+
+    const char * toString() {
+	return "CommandCue";
+    }
+};
+
+class CueQueue {
+    struct event timer_ev;
+    bool timer_set;
+    unsigned long seq;
+
+    struct later {
+	bool operator()(const Cue * a, const Cue * b) const {
+	    if (a->due.tv_sec != b->due.tv_sec)
+		return a->due.tv_sec > b->due.tv_sec;
+	    if (a->due.tv_nsec != b->due.tv_nsec)
+		return a->due.tv_nsec > b->due.tv_nsec;
+	    return a->seq > b->seq;
+	}
+    };
+    std::priority_queue<Cue*, std::vector<Cue*>, later> q;
+
+    // arm the timer for the earliest cue
+    void arm() {
+	struct timespec now;
+	struct timeval tv;
+	long usec;
+
+	if (timer_set) {
+	    evtimer_del(&timer_ev);
+	    timer_set = false;
+	}
+	if (q.empty()) return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (q.top()->due.tv_sec - now.tv_sec) * 1000000L
+	       + (q.top()->due.tv_nsec - now.tv_nsec) / 1000;
+	if (usec < 0) usec = 0;
+	tv.tv_sec = usec / 1000000L;
+	tv.tv_usec = usec % 1000000L;
+	evtimer_add(&timer_ev, &tv);
+	timer_set = true;
+    }
+
+public:
+    void add(Cue * c) {
+	c->seq = seq++;
+	q.push(c);
+	if (q.top() == c) arm();
+    }
+
+    void add(double delay, Json::Value & cmd) {
+	add(new CommandCue(delay, cmd));
+    }
+
+    size_t size() {
+	return q.size();
+    }
+
+    void run() {
+	struct timespec now;
+	timer_set = false;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	while (!q.empty()) {
+	    Cue * c = q.top();
+	    if (c->due.tv_sec > now.tv_sec
+		|| (c->due.tv_sec == now.tv_sec && c->due.tv_nsec > now.tv_nsec))
+		break;
+	    q.pop();
+	    try {
+		c->fire();
+	    } catch (const char * s) {
+		std::cerr << "error in " << c->toString() << " : '"
+			  << s << "'" << std::endl;
+	    }
+	    delete c;
+	}
+	arm();
+    }
+
+    void clear() {
+	while (!q.empty()) {
+	    delete q.top();
+	    q.pop();
+	}
+	arm();
+    }
+
+    static void cue_callback(int, short int, void * o) {
+	try {
+	    ((CueQueue*)o)->run();
+	} catch (...) {
+	    std::cerr << "unknown error in cue queue" << std::endl;
+	}
+    }
+
+    CueQueue() : timer_set(false), seq(0) {
+	evtimer_set(&timer_ev, cue_callback, this);
+    }
+
+    ~CueQueue() {
+	clear();
+    }
+};
+
+// starts a group of prepared sources with one alSourcePlayv
+class StartCue : public Cue {
+    // the serials of the sources, which may be gone by the time it fires
+    std::vector<unsigned long> serials;
+public:
+    StartCue(double delay, std::vector<Source*> & a) : Cue(delay) {
+	for (size_t i = 0; i < a.size(); i++) serials.push_back(a[i]->serial);
+    }
+
+    void fire();
+
+    const char * toString() {
+	return "StartCue";
+    }
+};
+
 class Device {
 public:
     std::vector<Source*> sources;
@@ -868,6 +2666,7 @@ public:
     std::map<std::string,Source*> name2source;
     Listener l;
     Animator animator;
+    CueQueue cues;
     ALCdevice * dev;
     ALCcontext * ctx;
 
@@ -891,6 +2690,14 @@ public:
 	    throw("Could not create context.");
 	}
 	alcMakeContextCurrent(ctx);
+	al_float32 = alIsExtensionPresent("AL_EXT_FLOAT32");
+
+	ALCint rate = 0, mono = 0, stereo = 0;
+	alcGetIntegerv(dev, ALC_FREQUENCY, 1, &rate);
+	device_rate = rate;
+	alcGetIntegerv(dev, ALC_MONO_SOURCES, 1, &mono);
+	alcGetIntegerv(dev, ALC_STEREO_SOURCES, 1, &stereo);
+	device_sources = mono + stereo;
     }
 
     void addName(std::string name, Source * s) {
@@ -901,6 +2708,7 @@ public:
 		      << std::endl;
 	}
 	name2source.insert(std::pair<std::string, Source*>(name, s));
+	if (s->name.empty()) s->name = name;
     }
 
     void makeSnapshot() {
@@ -918,13 +2726,9 @@ public:
     }
 
     void applySnapshot() {
-	size_t i;
-	if (sources.size() != snapshot.size()) {
-	    throw("mismatching snapshot");
-	}
-	for (i = 0; i < snapshot.size(); i++) {
-	    snapshot[i]->apply();
-	    sources[i]->update();
+	for (size_t i = 0; i < sources.size(); i++) {
+	    SourceSettings * snap = getSnapshot(sources[i]);
+	    if (snap) snap->apply(*sources[i]);
 	}
     }
 
@@ -945,6 +2749,23 @@ public:
 	return it->second;
     }
 
+    Source * findSource(const std::string & s) {
+	std::map<std::string,Source*>::iterator it = name2source.find(s);
+	return it == name2source.end() ? NULL : it->second;
+    }
+
+    SourceSettings * getSnapshot(Source * s) {
+	// never by AL id, which is reused once a source is deleted
+	size_t i;
+	for (i = 0; i < snapshot.size(); i++) {
+	    if (snapshot[i]->serial == s->serial) return snapshot[i];
+	}
+	for (i = 0; s->name.size() && i < snapshot.size(); i++) {
+	    if (snapshot[i]->name == s->name) return snapshot[i];
+	}
+	return NULL;
+    }
+
     Source * getSource(Json::Value & v) {
 	if (v.isNumeric()) {
 	    return getSource((size_t)v.asUInt());
@@ -956,21 +2777,20 @@ public:
     }
 
     void removeSource(Source * s) {
-	ALuint id = s->id;
-	std::vector<SourceSettings*>::reverse_iterator it2;
+	SourceSettings * snap = getSnapshot(s);
+	std::vector<SourceSettings*>::iterator it2;
 	std::vector<Source*>::reverse_iterator it3;
 
-	for (it2 = snapshot.rbegin(); it2 != snapshot.rend(); it2++) {
-
-	    if ((*it2)->id == id) {
-		delete(*it2);
-		snapshot.erase(--it2.base());
+	for (it2 = snapshot.begin(); it2 != snapshot.end(); it2++) {
+	    if (*it2 == snap) {
+		delete snap;
+		snapshot.erase(it2);
 		break;
 	    }
 	}
 
 	for (it3 = sources.rbegin(); it3 != sources.rend(); it3++) {
-	    if ((*it3)->id == id) {
+	    if (*it3 == s) {
 		delete(*it3);
 		sources.erase(--it3.base());
 		break;
@@ -1046,22 +2866,90 @@ public:
 	    (*it)->name();						\
 	}								\
     }
-    DEVICE_ACTION(Play)
-    DEVICE_ACTION(Pause)
-    DEVICE_ACTION(Stop)
     DEVICE_ACTION(Rewind)
 
-#undef FUN
-#define FUN(name, type)							\
-  void name (Json::Value & ids, Json::Value & f)			\
-    {									\
-	std::vector<Source*> a;						\
-	type _f;							\
-	Ids2Sources(ids, a);						\
-	Json2AL(f, _f);							\
-	size_t i;							\
-	for (i = 0; i < a.size(); i++) {				\
-	    a[i]-> name (_f);						\
+    // to "frame" or "time" (seconds) into the file
+    void Seek(Json::Value & ids, Json::Value & cmd) {
+	std::vector<Source*> a;
+	Ids2Sources(ids, a);
+
+	if (cmd.isMember("frame")) {
+	    if (!cmd["frame"].isNumeric() || cmd["frame"].asDouble() < 0.0)
+		throw("bad frame");
+	    for (size_t i = 0; i < a.size(); i++)
+		a[i]->Seek((size_t)cmd["frame"].asDouble());
+	} else if (cmd.isMember("time")) {
+	    if (!cmd["time"].isNumeric()) throw("bad time");
+	    for (size_t i = 0; i < a.size(); i++)
+		a[i]->Seek(cmd["time"].asDouble());
+	} else throw("seek needs a frame or time");
+    }
+
+    // sources are prepared first and then started with a single
+    // alSourcePlayv, so that they start on the same sample. with a delay
+    // only the start itself is scheduled.
+    void Play(Json::Value & ids, double delay = 0.0) {
+	std::vector<Source*> a, p;
+	std::vector<ALuint> v;
+	Ids2Sources(ids, a);
+
+	for (size_t i = 0; i < a.size(); i++) {
+	    if (a[i]->Prepare(delay > 0.0)) {
+		p.push_back(a[i]);
+		v.push_back(a[i]->id);
+	    }
+	}
+	if (!v.size()) return;
+
+	if (delay > 0.0) {
+	    cues.add(new StartCue(delay, p));
+	} else {
+	    alSourcePlayv(v.size(), &v[0]);
+	}
+    }
+
+    void Stop(std::vector<Source*> & a) {
+	std::vector<ALuint> v;
+	size_t i;
+
+	for (i = 0; i < a.size(); i++) {
+	    if (a[i]->id) v.push_back(a[i]->id);
+	}
+	if (v.size()) alSourceStopv(v.size(), &v[0]);
+	for (i = 0; i < a.size(); i++) a[i]->Stopped();
+    }
+
+    void Stop(Json::Value & ids) {
+	std::vector<Source*> a;
+	Ids2Sources(ids, a);
+	Stop(a);
+    }
+
+    void Pause(Json::Value & ids) {
+	std::vector<Source*> a;
+	std::vector<ALuint> v;
+	Ids2Sources(ids, a);
+
+	for (size_t i = 0; i < a.size(); i++) {
+	    a[i]->paused = true;
+	    a[i]->cued = false;
+	    a[i]->timer_stop();
+	    if (a[i]->id) v.push_back(a[i]->id);
+	}
+	if (v.size()) alSourcePausev(v.size(), &v[0]);
+    }
+
+#undef FUN
+#define FUN(name, type)							\
+  void name (Json::Value & ids, Json::Value & f)			\
+    {									\
+	std::vector<Source*> a;						\
+	type _f;							\
+	Ids2Sources(ids, a);						\
+	Json2AL(f, _f);							\
+	size_t i;							\
+	for (i = 0; i < a.size(); i++) {				\
+	    a[i]-> name (_f);						\
 	}								\
     }
 
@@ -1071,6 +2959,9 @@ public:
     FUN(gain, ALfloat)
     FUN(pitch, ALfloat)
     FUN(loop, bool)
+    FUN(loop_start, ALint)
+    FUN(loop_end, ALint)
+    FUN(loop_crossfade, ALfloat)
     FUN(position, ALfv)
     FUN(velocity, ALfv)
 
@@ -1096,10 +2987,8 @@ public:
     std::vector<ALuint> paused;
 
     void StopAll() {
-	for (size_t i = 0; i < sources.size(); i++) {
-	    paused.push_back(sources[i]->id);
-	}
-	alSourceStopv(paused.size(), &(paused[0]));
+	Stop(sources);
+	paused.clear();
 	animator.clear();
     }
 
@@ -1139,7 +3028,32 @@ public:
 
 Device * dev = NULL;
 
+void StartCue::fire() {
+    std::vector<Source*> a;
+    std::vector<ALuint> v;
+
+    // sources might have been removed or replaced in the meantime, and
+    // their AL ids given to others. one that was stopped or played since
+    // is no longer cued.
+    for (size_t i = 0; i < serials.size(); i++) {
+	for (size_t j = 0; j < dev->sources.size(); j++) {
+	    Source * s = dev->sources[j];
+	    if (s->serial == serials[i]) {
+		if (s->cued) {
+		    a.push_back(s);
+		    v.push_back(s->id);
+		}
+		break;
+	    }
+	}
+    }
+    if (!v.size()) return;
+    alSourcePlayv(v.size(), &v[0]);
+    for (size_t i = 0; i < a.size(); i++) a[i]->Started();
+}
+
 std::string sound_path, script_path;
+bool lazy_sources = false;
 
 static const char * conf_names[] = {
     "../soundspace/soundspace.conf",
@@ -1153,17 +3067,241 @@ static const char * conf_names[] = {
 };
 
 
-Source * sourceFromFile(std::string & file, std::string & name) {
+std::vector<Bank*> banks;
+
+// a buffer for file, from the first bank which has it
+Buffer * newBuffer(std::string & file, bool lazy) {
+    for (size_t i = 0; i < banks.size(); i++) {
+	const struct ss_bank_entry * e = banks[i]->find(file);
+	if (e) return new Buffer(banks[i], e);
+    }
     std::string path = sound_path + file;
-    Buffer * buf = new Buffer(path);
+    return new Buffer(path, lazy);
+}
+
+// banks stay mapped until exit, a reload only adds new ones. the new ones
+// are mapped into fresh first, and none of them is kept if one fails.
+void openBanks(Json::Value & v, const std::string & path,
+	       std::vector<Bank*> & fresh) {
+    try {
+	for (Json::Value::ArrayIndex i = 0; i < v.size(); i++) {
+	    std::string file = path + v[i].asString();
+	    bool known = false;
+	    for (size_t k = 0; k < banks.size(); k++)
+		if (banks[k]->path == file) known = true;
+	    for (size_t k = 0; k < fresh.size(); k++)
+		if (fresh[k]->path == file) known = true;
+	    if (known) continue;
+	    fresh.push_back(new Bank(file));
+	}
+    } catch (const char * e) {
+	for (size_t k = 0; k < fresh.size(); k++) delete fresh[k];
+	fresh.clear();
+	throw;
+    }
+}
+
+Source * sourceFromFile(std::string & file, std::string & name,
+			bool lazy = false) {
+    Buffer * buf = newBuffer(file, lazy);
     Source * s = dev->getSource();
     s->add(buf);
     dev->addName(name, s);
     return s;
 }
 
-Source * sourceFromFile(std::string & file) {
-    return sourceFromFile(file, file);
+Source * sourceFromFile(std::string & file, bool lazy = false) {
+    return sourceFromFile(file, file, lazy);
+}
+
+// plays another file on sources, keeping their name, settings and
+// animations. playing sources switch without a gap, see SetBuffer().
+void setFile(Json::Value & ids, Json::Value & cmd) {
+    std::vector<Source*> a;
+    ALfloat fade = 0.0f;
+    bool sync = false;
+
+    if (!cmd["file"].isString())
+	throw("bad file. expected string.");
+    std::string file = cmd["file"].asString();
+    if (cmd.isMember("crossfade")) {
+	Json2AL(cmd["crossfade"], fade);
+	if (fade < 0.0f) throw("crossfade must not be negative");
+    }
+    if (cmd.isMember("sync")) Json2AL(cmd["sync"], sync);
+
+    dev->Ids2Sources(ids, a);
+    for (size_t i = 0; i < a.size(); i++) {
+	Source * s = a[i];
+	// a playing source needs the new file loaded before it switches
+	bool playing = s->buffer && (s->paused || s->state() == AL_PLAYING);
+	bool lazy = s->buffer ? s->buffer->lazy : lazy_sources;
+	s->SetBuffer(newBuffer(file, lazy && !playing), fade, sync);
+    }
+}
+
+/*
+ * Short sounds which are fired and forgotten, maybe many at once. A clip
+ * is read and converted into a single AL buffer when it is loaded, and
+ * played on a voice from a pool of AL sources made up front, so a trigger
+ * makes no system calls and allocates nothing. Voices which are done go
+ * back to the pool, and when all of them are busy the oldest one is taken.
+ */
+class TriggerPool {
+    std::map<std::string, ALuint> clips;
+    std::vector<ALuint> idle;
+    std::deque<ALuint> busy;	// oldest first
+    struct event timer_ev;
+    bool timer_set;
+    std::string key;
+
+    static const long RECLAIM_MS = 100;
+
+    void reclaim() {
+	ALint state;
+	for (size_t i = 0; i < busy.size(); ) {
+	    alGetSourcei(busy[i], AL_SOURCE_STATE, &state);
+	    if (state == AL_PLAYING) {
+		i++;
+		continue;
+	    }
+	    alSourcei(busy[i], AL_BUFFER, 0);
+	    idle.push_back(busy[i]);
+	    busy.erase(busy.begin() + i);
+	}
+    }
+
+    void timer_continue() {
+	const struct timeval t = { 0, RECLAIM_MS * 1000 };
+	if (!timer_set && !busy.empty()) {
+	    evtimer_add(&timer_ev, &t);
+	    timer_set = true;
+	}
+    }
+
+    static void timer_cb(int, short, void * o) {
+	TriggerPool * self = (TriggerPool*)o;
+	self->timer_set = false;
+	self->reclaim();
+	self->timer_continue();
+    }
+
+public:
+    size_t voices;
+    unsigned long triggered, stolen;
+
+    TriggerPool() : timer_set(false), voices(0), triggered(0), stolen(0) {}
+
+    // the pool only grows, a reload may ask for more voices
+    void grow(size_t n) {
+	if (!voices) evtimer_set(&timer_ev, timer_cb, this);
+	idle.reserve(n);
+	for (; voices < n; voices++) {
+	    ALuint id;
+	    alGenSources(1, &id);
+	    checkError();
+	    idle.push_back(id);
+	    buffer_cache.sources++;
+	}
+    }
+
+    size_t active() {
+	return busy.size();
+    }
+
+    void load(std::string & file) {
+	if (clips.count(file)) return;
+
+	Buffer * b = newBuffer(file, false);
+	size_t len = (b->data_end - b->data_start) / b->block_size * b->block_size;
+	std::vector<char> out(len / b->block_size * b->block_frames * b->out_frame_size());
+	ALuint id;
+
+	if (out.empty()) {
+	    delete b;
+	    throw("empty clip");
+	}
+	b->render(b->data_start, len, &out[0]);
+	alGenBuffers(1, &id);
+	alBufferData(id, b->format, &out[0], out.size(), b->frequency);
+	delete b;
+	checkError();
+	clips[file] = id;
+    }
+
+    // plays a clip at position, relative to the listener if asked to
+    void trigger(const std::string & clip, const ALfloat * position,
+		 ALfloat gain, ALfloat pitch, bool relative) {
+	std::map<std::string, ALuint>::iterator it = clips.find(clip);
+	ALuint v;
+
+	if (it == clips.end()) throw("unknown clip");
+	if (!voices) throw("no trigger voices");
+
+	if (idle.empty()) reclaim();
+	if (idle.empty()) {
+	    v = busy.front();
+	    busy.pop_front();
+	    alSourceStop(v);
+	    stolen++;
+	} else {
+	    v = idle.back();
+	    idle.pop_back();
+	}
+
+	alSourcei(v, AL_BUFFER, it->second);
+	alSourcefv(v, AL_POSITION, position);
+	alSourcef(v, AL_GAIN, gain);
+	alSourcef(v, AL_PITCH, pitch);
+	alSourcei(v, AL_SOURCE_RELATIVE, relative ? AL_TRUE : AL_FALSE);
+	alSourcePlay(v);
+	busy.push_back(v);
+	triggered++;
+	timer_continue();
+	checkError();
+    }
+
+    // for the fast path, which only triggers known clips
+    bool has(const char * clip, size_t n) {
+	key.assign(clip, n);
+	return voices && clips.count(key);
+    }
+
+    void trigger(const char * clip, size_t n, const ALfloat * position,
+		 ALfloat gain, ALfloat pitch) {
+	key.assign(clip, n);
+	trigger(key, position, gain, pitch, false);
+    }
+};
+
+TriggerPool triggers;
+
+// {"cmd":"trigger", "clip":"hit.wav", "position":[...], "gain":..., "pitch":...}
+void triggerClip(Json::Value & cmd) {
+    ALfloat position[3] = { 0.0f, 0.0f, 0.0f };
+    ALfloat gain = 1.0f, pitch = 1.0f;
+    bool relative = false;
+
+    if (!cmd["clip"].isString()) throw("bad clip. expected string.");
+    if (cmd.isMember("position")) Json2AL(cmd["position"], position);
+    if (cmd.isMember("gain")) Json2AL(cmd["gain"], gain);
+    if (cmd.isMember("pitch")) Json2AL(cmd["pitch"], pitch);
+    if (cmd.isMember("relative")) Json2AL(cmd["relative"], relative);
+    triggers.trigger(cmd["clip"].asString(), position, gain, pitch, relative);
+}
+
+void loadClips(Json::Value & v) {
+    if (!v.isArray())
+	throw("bad configuration 'clips'. Expected array.");
+    for (Json::Value::ArrayIndex i = 0; i < v.size(); i++) {
+	std::string file = v[i].asString();
+	try {
+	    triggers.load(file);
+	} catch (const char * e) {
+	    std::cerr << "error in clip '" << file << "': '" << e << "'"
+		      << std::endl;
+	}
+    }
 }
 
 #define CONFIG_SET(m, s, name)    do {				\
@@ -1175,17 +3313,22 @@ Source * sourceFromJSON(Json::Value & sinfo) {
 
     if (sinfo.isMember("file")) {
 	std::string file = sinfo["file"].asString();
+	bool lazy = lazy_sources;
+	if (sinfo.isMember("lazy")) Json2AL(sinfo["lazy"], lazy);
 	if (sinfo.isMember("name")) {
 	    std::string name = sinfo["name"].asString();
-	    s = sourceFromFile(file, name);
+	    s = sourceFromFile(file, name, lazy);
 	} else {
-	    s = sourceFromFile(file);
+	    s = sourceFromFile(file, lazy);
 	}
 	CONFIG_SET(sinfo, s, position);
 	CONFIG_SET(sinfo, s, velocity);
 	CONFIG_SET(sinfo, s, gain);
 	CONFIG_SET(sinfo, s, pitch);
 	CONFIG_SET(sinfo, s, loop);
+	CONFIG_SET(sinfo, s, loop_start);
+	CONFIG_SET(sinfo, s, loop_end);
+	CONFIG_SET(sinfo, s, loop_crossfade);
     } else {
 	std::cerr << "file location missing" << std::endl;
     }
@@ -1196,6 +3339,7 @@ Source * sourceFromJSON(Json::Value & sinfo) {
 __attribute__((noreturn))
 void shutdown(int code) {
     comm.send_error("shutdown");
+    comm.flush();
     try {
 	if (dev) delete(dev);
     } catch (const char * s) {
@@ -1210,6 +3354,215 @@ void shutdown(int code, const char * s) {
     shutdown(code);
 }
 
+std::string config_file;
+// the pages a browser may send commands from over http
+Json::Value http_origins(Json::arrayValue);
+
+// the global options, which may also change on reload. an option missing
+// from the configuration has its default, so removing it and reloading
+// takes it back. the trigger pool only grows though.
+struct Options {
+    std::string sound_path, script_path, resample_cache;
+    bool lazy, resample, meters;
+    unsigned int max_open_files, max_mapped_mb, max_sources, readahead_chunks,
+		 max_resident_mb, trigger_voices, meter_interval_ms,
+		 max_message_kb;
+    Json::Value banks, clips, http_origins;
+
+    Options() : resample_cache("/tmp/soundspace-resampled"), lazy(false),
+		resample(false), meters(false), max_open_files(0),
+		max_mapped_mb(0), max_sources(0), readahead_chunks(2), max_resident_mb(0),
+		trigger_voices(0), meter_interval_ms(100),
+		max_message_kb(Interpol::DEFAULT_MAX_MESSAGE >> 10),
+		banks(Json::arrayValue), clips(Json::arrayValue),
+		http_origins(Json::arrayValue) {}
+};
+
+static void badOption(const char * name) {
+    std::cerr << "bad configuration option '" << name << "'" << std::endl;
+}
+
+static void option(Json::Value & conf, const char * name, std::string & v) {
+    if (!conf.isMember(name)) return;
+    if (!conf[name].isString()) {
+	badOption(name);
+	throw("bad configuration. expected string.");
+    }
+    v = conf[name].asString();
+}
+
+static void option(Json::Value & conf, const char * name, bool & v) {
+    if (!conf.isMember(name)) return;
+    if (!conf[name].isBool()) {
+	badOption(name);
+	throw("bad configuration. expected true or false.");
+    }
+    v = conf[name].asBool();
+}
+
+static void option(Json::Value & conf, const char * name, unsigned int & v) {
+    if (!conf.isMember(name)) return;
+    if (!conf[name].isUInt()) {
+	badOption(name);
+	throw("bad configuration. expected a positive integer.");
+    }
+    v = conf[name].asUInt();
+}
+
+// a list of files or origins
+static void option(Json::Value & conf, const char * name, Json::Value & v) {
+    if (!conf.isMember(name)) return;
+    Json::Value & a = conf[name];
+    bool ok = a.isArray();
+    for (Json::Value::ArrayIndex i = 0; ok && i < a.size(); i++)
+	ok = a[i].isString();
+    if (!ok) {
+	badOption(name);
+	throw("bad configuration. expected array of strings.");
+    }
+    v = a;
+}
+
+// the settings of a source, as sourceFromJSON() and updateSource() take them
+static void checkSource(Json::Value & sinfo) {
+    ALfloat v[3], f;
+    ALint i;
+    bool b;
+
+    if (!sinfo.isObject())
+	throw("bad configuration 'sources'. Expected objects.");
+    if (sinfo.isMember("file") && !sinfo["file"].isString())
+	throw("bad file. expected string.");
+    if (sinfo.isMember("name") && !sinfo["name"].isString())
+	throw("bad name. expected string.");
+    if (sinfo.isMember("lazy")) Json2AL(sinfo["lazy"], b);
+    if (sinfo.isMember("loop")) Json2AL(sinfo["loop"], b);
+    if (sinfo.isMember("position")) Json2AL(sinfo["position"], v);
+    if (sinfo.isMember("velocity")) Json2AL(sinfo["velocity"], v);
+    if (sinfo.isMember("gain")) Json2AL(sinfo["gain"], f);
+    if (sinfo.isMember("pitch")) Json2AL(sinfo["pitch"], f);
+    if (sinfo.isMember("loop_crossfade")) Json2AL(sinfo["loop_crossfade"], f);
+    if (sinfo.isMember("loop_start")) Json2AL(sinfo["loop_start"], i);
+    if (sinfo.isMember("loop_end")) Json2AL(sinfo["loop_end"], i);
+}
+
+static void checkListener(Json::Value & l) {
+    ALfloat v[6];
+
+    if (!l.isObject())
+	throw("bad configuration 'listener'. Expected object.");
+    if (l.isMember("orientation")) Json2AL(l["orientation"], v, 6);
+    if (l.isMember("position")) Json2AL(l["position"], v);
+    if (l.isMember("velocity")) Json2AL(l["velocity"], v);
+}
+
+// checks the whole configuration and reads its global options, without
+// changing anything
+void readOptions(Json::Value & conf, Options & o) {
+    std::string path;
+
+    if (!conf.isObject())
+	throw("bad configuration. expected object.");
+
+    if (conf.isMember("path")) {
+	option(conf, "path", path);
+	o.sound_path = path + "/";
+    }
+    if (conf.isMember("script_path")) {
+	option(conf, "script_path", path);
+	o.script_path = path + "/";
+    }
+    option(conf, "lazy", o.lazy);
+    option(conf, "banks", o.banks);
+    option(conf, "max_open_files", o.max_open_files);
+    option(conf, "max_mapped_mb", o.max_mapped_mb);
+    option(conf, "max_sources", o.max_sources);
+    option(conf, "resample", o.resample);
+    option(conf, "resample_cache", o.resample_cache);
+    option(conf, "readahead_chunks", o.readahead_chunks);
+    option(conf, "max_resident_mb", o.max_resident_mb);
+    option(conf, "trigger_voices", o.trigger_voices);
+    option(conf, "clips", o.clips);
+    option(conf, "http_origins", o.http_origins);
+    option(conf, "meters", o.meters);
+    option(conf, "meter_interval_ms", o.meter_interval_ms);
+    option(conf, "max_message_kb", o.max_message_kb);
+
+    if (!conf.isMember("listener"))
+	throw("no listener found");
+    checkListener(conf["listener"]);
+
+    if (conf.isMember("sources")) {
+	Json::Value & v = conf["sources"];
+	if (!v.isArray())
+	    throw("bad configuration 'sources'. Expected array.");
+	for (Json::Value::ArrayIndex i = 0; i < v.size(); i++)
+	    checkSource(v[i]);
+    }
+}
+
+// makes o the current options, along with the banks mapped for it
+void applyOptions(Options & o, std::vector<Bank*> & fresh) {
+    sound_path = o.sound_path;
+    script_path = o.script_path;
+    lazy_sources = o.lazy;
+
+    for (size_t k = 0; k < fresh.size(); k++) {
+	banks.push_back(fresh[k]);
+	std::cerr << "loaded bank '" << fresh[k]->path << "' with "
+		  << fresh[k]->count << " sounds" << std::endl;
+    }
+
+    buffer_cache.max_open = o.max_open_files;
+    buffer_cache.max_mapped = (size_t)o.max_mapped_mb << 20;
+    buffer_cache.max_sources = o.max_sources;
+    resample_files = o.resample;
+    resample_cache = o.resample_cache;
+    residency.readahead = o.readahead_chunks;
+    residency.budget = (size_t)o.max_resident_mb << 20;
+
+    if (o.trigger_voices) triggers.grow(o.trigger_voices);
+    if (o.clips.size()) {
+	if (!triggers.voices) triggers.grow(16);
+	loadClips(o.clips);
+    }
+
+    // clients may have asked for the meters, whatever the configuration
+    metering = o.meters || metering_asked;
+    meter_interval_ms = o.meter_interval_ms;
+    http_origins = o.http_origins;
+    comm.limit((size_t)o.max_message_kb << 10);
+
+    if (lazy_sources && !buffer_cache.max_open) {
+	// leave some room for sockets, scripts and eager sources
+	struct rlimit rl;
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY
+	    && rl.rlim_cur > 128)
+	    buffer_cache.max_open = rl.rlim_cur - 64;
+    }
+    if (lazy_sources && !buffer_cache.max_sources)
+	buffer_cache.max_sources = device_sources;
+}
+
+// global options which may also change on reload. if anything in the
+// configuration is bad, it throws before changing anything.
+void configure(Json::Value & conf) {
+    Options o;
+    std::vector<Bank*> fresh;
+
+    readOptions(conf, o);
+    openBanks(o.banks, o.sound_path, fresh);
+    applyOptions(o, fresh);
+}
+
+void configureListener(Json::Value & v) {
+    if (!v.isObject())
+	throw("bad configuration 'listener'. Expected object.");
+    CONFIG_SET(v, &(dev->l), orientation);
+    CONFIG_SET(v, &(dev->l), position);
+    CONFIG_SET(v, &(dev->l), velocity);
+}
+
 void setup() {
     std::ifstream cfile;
     Json::Reader r;
@@ -1217,11 +3570,12 @@ void setup() {
     Json::Value::ArrayIndex n;
     unsigned int i;
 
-    for (i = 0; i < sizeof(*conf_names); i++) {
+    for (i = 0; i < sizeof(conf_names)/sizeof(*conf_names); i++) {
 	std::cerr << "trying to open config file '" << conf_names[i] << "'" << std::endl;
 	cfile.open(conf_names[i]);
 	if (!cfile.fail()) {
 	    std::cerr << "opened config file '" << conf_names[i] << "'" << std::endl;
+	    config_file = conf_names[i];
 	    break;
 	}
     }
@@ -1243,21 +3597,13 @@ void setup() {
 	    dev = new Device();
 	}
 
+	configure(config);
+
 	if (!!(v = config["sources"]) && v.isArray() && (n = v.size()) > 0) {
 	    Json::Value::ArrayIndex i;
 
 	    std::cerr << "found " << n << " sources" << std::endl;
 
-	    if (config.isMember("path")) {
-		sound_path = config["path"].asString();
-		sound_path.append("/");
-	    }
-
-	    if (config.isMember("script_path")) {
-		script_path = config["script_path"].asString();
-		script_path.append("/");
-	    }
-
 	    for (i = 0; i < n; i++) {
 		Json::Value sinfo = v[i];
 		sourceFromJSON(sinfo);
@@ -1267,12 +3613,7 @@ void setup() {
 	}
 
 	if (config.isMember("listener")) {
-	    v = config["listener"];
-	    if (!v.isObject())
-		throw("bad configuration 'listener'. Expected object.");
-	    CONFIG_SET(v, &(dev->l), orientation);
-	    CONFIG_SET(v, &(dev->l), position);
-	    CONFIG_SET(v, &(dev->l), velocity);
+	    configureListener(config["listener"]);
 	} else shutdown(1, "no listener found");
 
     } catch (const char * s) {
@@ -1290,76 +3631,1681 @@ void setup() {
 #endif
 }
 
-void interpol_callback(Json::Value & root) {
-    try {
-	if (root["cmd"] == "play") {
-	    dev->Play(root["ids"]);
-	} else if (root["cmd"] == "eval") {
-	    if (!root["script"].isString()) {
-		throw("bad script file. expected string.");
+static std::string sourceKey(Json::Value & sinfo) {
+    return sinfo.isMember("name") ? sinfo["name"].asString()
+				  : sinfo["file"].asString();
+}
+
+// the value of a setting of a source entry, or its default if the entry
+// has none, so that a setting removed from the configuration is reset
+static Json::Value sourceSetting(Json::Value & sinfo, const char * name) {
+    static Json::Value defaults;
+
+    if (defaults.isNull()) {
+	Json::Value zero(Json::arrayValue);
+	zero.append(0.0);
+	zero.append(0.0);
+	zero.append(0.0);
+	defaults["position"] = zero;
+	defaults["velocity"] = zero;
+	defaults["gain"] = 1.0;
+	defaults["pitch"] = 1.0;
+	defaults["loop"] = false;
+	defaults["loop_start"] = 0;
+	defaults["loop_end"] = 0;
+	defaults["loop_crossfade"] = 0.0;
+    }
+    return sinfo.isMember(name) ? sinfo[name] : defaults[name];
+}
+
+#define CONFIG_UPDATE(old, m, s, snap, name)    do {			\
+	Json::Value v = sourceSetting(m, #name);			\
+	if (v != sourceSetting(old, #name)) {				\
+	    (s)-> name (v);						\
+	    if (snap) Json2AL(v, (snap)-> name ## _value);		\
+	}								\
+    } while (0)
+
+// apply the differences between two configuration entries of one source.
+// a different file replaces the buffer, everything else is set in place.
+void updateSource(Source * s, Json::Value & old, Json::Value & sinfo,
+		  bool path_changed) {
+    SourceSettings * snap = dev->getSnapshot(s);
+
+    if (path_changed || old["file"] != sinfo["file"]
+	|| old["lazy"] != sinfo["lazy"]) {
+	std::string file = sinfo["file"].asString();
+	bool lazy = lazy_sources;
+	if (sinfo.isMember("lazy")) Json2AL(sinfo["lazy"], lazy);
+
+	Buffer * buf = newBuffer(file, lazy);
+	bool playing = s->state() == AL_PLAYING;
+	s->Stop();
+	s->add(buf);
+	if (playing) s->Play();
+    }
+
+    CONFIG_UPDATE(old, sinfo, s, snap, position);
+    CONFIG_UPDATE(old, sinfo, s, snap, velocity);
+    CONFIG_UPDATE(old, sinfo, s, snap, gain);
+    CONFIG_UPDATE(old, sinfo, s, snap, pitch);
+
+    Json::Value v;
+    if ((v = sourceSetting(sinfo, "loop")) != sourceSetting(old, "loop"))
+	s->loop(v);
+    if ((v = sourceSetting(sinfo, "loop_start")) != sourceSetting(old, "loop_start"))
+	s->loop_start(v);
+    if ((v = sourceSetting(sinfo, "loop_end")) != sourceSetting(old, "loop_end"))
+	s->loop_end(v);
+    if ((v = sourceSetting(sinfo, "loop_crossfade"))
+	!= sourceSetting(old, "loop_crossfade"))
+	s->loop_crossfade(v);
+}
+
+// read the configuration file again and apply only what changed. sources
+// are matched by name (or file if they have no name), so untouched sources
+// keep playing. a bad configuration is refused as a whole, before anything
+// changed.
+void reload() {
+    std::ifstream cfile(config_file.c_str());
+    Json::Reader r;
+    Json::Value nconfig;
+    std::map<std::string, Json::Value> old_entries;
+    std::map<std::string, Json::Value>::iterator it;
+    Json::Value::ArrayIndex i, n;
+    size_t added = 0, updated = 0, removed = 0;
+
+    if (cfile.fail() || !r.parse(cfile, nconfig, false) || !nconfig.isObject())
+	throw("could not read configuration. keeping the old one.");
+
+    std::string old_path = sound_path;
+    configure(nconfig);
+    bool path_changed = old_path != sound_path;
+
+    Json::Value & olds = config["sources"];
+    if (olds.isArray()) {
+	for (i = 0, n = olds.size(); i < n; i++) {
+	    if (olds[i].isMember("file"))
+		old_entries[sourceKey(olds[i])] = olds[i];
+	}
+    }
+
+    Json::Value & news = nconfig["sources"];
+    if (news.isArray()) {
+	for (i = 0, n = news.size(); i < n; i++) {
+	    Json::Value & sinfo = news[i];
+	    if (!sinfo.isMember("file")) continue;
+
+	    std::string key = sourceKey(sinfo);
+	    Source * s = dev->findSource(key);
+	    Json::Value old;
+
+	    it = old_entries.find(key);
+	    if (it != old_entries.end()) {
+		old = it->second;
+		old_entries.erase(it);
 	    }
-	    std::string file = script_path;
-	    std::cerr << "script_path: " << script_path << std::endl;
-	    file.append(root["script"].asCString());
-	    comm.eval(file);
-	} else if (root["cmd"] == "add_source") {
-	    Source * s = sourceFromJSON(root);
-	    if (s) dev->snapshot.push_back(s->copy());
-	} else if (root["cmd"] == "remove_source") {
-	    dev->removeSources(root["ids"]);
-	} else if (root["cmd"] == "stop_audio") {
-	    dev->Stop(root["ids"]);
-	} else if (root["cmd"] == "reset_audio") {
-	    dev->StopAll();
-	    dev->applySnapshot();
-	} else if (root["cmd"] == "stop_all") {
-	    dev->StopAll();
-	} else if (root["cmd"] == "pause") {
-	    dev->Pause(root["ids"]);
-	} else if (root["cmd"] == "rewind") {
-	    dev->Rewind(root["ids"]);
-	} else if (root["cmd"] == "position") {
-	    if (root.isMember("ids")) 
-		dev->position(root["ids"], root["position"]);
-	    else 
-		dev->getSource(root["id"])->position(root["position"]);
-	} else if (root["cmd"] == "gain") {
-	    if (root.isMember("ids"))
-		dev->gain(root["ids"], root["gain"]);
-	    else
-		dev->getSource(root["id"])->gain(root["gain"]);
-	} else if (root["cmd"] == "fade") {
-	    dev->Fade(root["ids"], root["time"], root["gain"]);
-	} else if (root["cmd"] == "scale") {
-	    dev->Scale(root["ids"], root["time"], root["speed"]);
-	} else if (root["cmd"] == "rotate") {
-	    dev->Rotate(root["ids"], root["time"], root["speed"]);
-	} else if (root["cmd"] == "pause_all") {
-	    dev->PauseAll();
-	} else if (root["cmd"] == "continue_all") {
-	    dev->ContinueAll();
-	} else if (root["cmd"] == "loop") {
-	    dev->loop(root["ids"], root["loop"]);
-	} else if (root["cmd"] == "die_audio") {
-	    shutdown(1, "dying");
+
+	    // a broken entry should not take the others with it
+	    try {
+		if (!s) {
+		    if ((s = sourceFromJSON(sinfo)))
+			dev->snapshot.push_back(s->copy());
+		    added++;
+		} else if (old != sinfo || path_changed) {
+		    updateSource(s, old, sinfo, path_changed);
+		    updated++;
+		}
+	    } catch (const char * e) {
+		std::cerr << "error in source '" << key << "': '" << e << "'"
+			  << std::endl;
+	    }
+	}
+    }
+
+    // whatever is left was removed from the configuration
+    for (it = old_entries.begin(); it != old_entries.end(); it++) {
+	Source * s = dev->findSource(it->first);
+	if (!s) continue;
+	dev->animator.removeSource(s);
+	dev->removeSource(s);
+	removed++;
+    }
+
+    // settings missing from the new listener go back to their defaults
+    if (nconfig["listener"] != config["listener"]) {
+	dev->l = Listener();
+	configureListener(nconfig["listener"]);
+    }
+
+    if (nconfig["device"] != config["device"])
+	std::cerr << "changing the device needs a restart." << std::endl;
+
+    config = nconfig;
+
+    std::cerr << "reloaded configuration: " << added << " added, "
+	      << updated << " updated, " << removed << " removed"
+	      << std::endl;
+}
+
+struct event config_ev;
+
+static void config_watch_cb(int fd, short, void *) {
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    std::string base = config_file.substr(config_file.rfind('/') + 1);
+    bool changed = false;
+    ssize_t len;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+	for (char * p = buf; p < buf + len; ) {
+	    const struct inotify_event * e = (const struct inotify_event *)p;
+	    if (e->len && base == e->name) changed = true;
+	    p += sizeof(struct inotify_event) + e->len;
 	}
+    }
+
+    if (!changed) return;
+
+    try {
+	reload();
     } catch (const char * s) {
-	std::cerr << "error in " << root["cmd"].asString() << ": '"
-		  << s << "'" << std::endl;
+	std::cerr << "error in reload: '" << s << "'" << std::endl;
     } catch (...) {
-	std::cerr << "unknown error in " << root["cmd"].asString() << std::endl;
+	std::cerr << "unknown error in reload" << std::endl;
     }
 }
 
-int main(int argc, char ** argv) {
-    struct event ev;
+// watch the directory rather than the file itself, since most editors
+// replace the file on save.
+void watchConfig() {
+    size_t slash = config_file.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : config_file.substr(0, slash);
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 
-    event_init();
-#ifdef TESTING
-    comm.seperator = '\n';
+    if (fd == -1 || inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+	std::cerr << "could not watch configuration in '" << dir << "'" << std::endl;
+	if (fd != -1) close(fd);
+	return;
+    }
+
+    event_set(&config_ev, fd, EV_READ | EV_PERSIST, config_watch_cb, NULL);
+    event_add(&config_ev, NULL);
+}
+
+/*
+ * The shared memory command ring (see soundspace_shm.h), drained from a
+ * timer so that high rate controllers cost no system calls per update.
+ */
+class ShmCommands {
+    struct ss_cmd_ring * r;
+    struct event timer_ev;
+    struct timeval tick;
+
+    void apply(struct ss_cmd & c) {
+	Source * src = NULL;
+
+	if (c.op < SS_CMD_LISTENER_POSITION) {
+	    if (c.handle >= dev->sources.size()) return;
+	    src = dev->sources[c.handle];
+	}
+	switch (c.op) {
+	case SS_CMD_POSITION: src->position(c.v); break;
+	case SS_CMD_VELOCITY: src->velocity(c.v); break;
+	case SS_CMD_GAIN: src->gain(c.v[0]); break;
+	case SS_CMD_PITCH: src->pitch(c.v[0]); break;
+	case SS_CMD_LISTENER_POSITION: dev->l.position(c.v); break;
+	case SS_CMD_LISTENER_VELOCITY: dev->l.velocity(c.v); break;
+	case SS_CMD_LISTENER_ORIENTATION: dev->l.orientation(c.v); break;
+	}
+    }
+
+public:
+    unsigned long applied;
+
+    ShmCommands(const std::string & name, double tick_ms) : applied(0) {
+	int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0660);
+	if (fd == -1) throw("could not create shared memory for commands");
+	if (ftruncate(fd, sizeof(*r)) == -1) {
+	    close(fd);
+	    throw("could not size shared memory for commands");
+	}
+	r = (struct ss_cmd_ring *)mmap(NULL, sizeof(*r), PROT_READ | PROT_WRITE,
+				       MAP_SHARED, fd, 0);
+	close(fd);
+	if (r == MAP_FAILED) throw("could not map shared memory for commands");
+	ss_cmd_init(r);
+
+	long usec = (long)(tick_ms * 1000.0);
+	if (usec < 100) usec = 100;
+	tick.tv_sec = usec / 1000000L;
+	tick.tv_usec = usec % 1000000L;
+	evtimer_set(&timer_ev, timer_cb, this);
+	evtimer_add(&timer_ev, &tick);
+    }
+
+    ~ShmCommands() {
+	evtimer_del(&timer_ev);
+	munmap(r, sizeof(*r));
+    }
+
+    // at most one ring full per tick, producers keep going meanwhile
+    void drain() {
+	struct ss_cmd c;
+	for (unsigned int i = 0; i < SS_CMD_SLOTS && ss_cmd_pop(r, &c); i++) {
+	    try {
+		apply(c);
+		applied++;
+	    } catch (const char * s) {
+		std::cerr << "error in shared memory command " << c.op
+			  << ": '" << s << "'" << std::endl;
+	    }
+	}
+    }
+
+    unsigned long dropped() {
+	return __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+
+    static void timer_cb(int, short, void * obj) {
+	ShmCommands * self = (ShmCommands*)obj;
+	self->drain();
+	evtimer_add(&self->timer_ev, &self->tick);
+    }
+};
+
+ShmCommands * shm_commands = NULL;
+
+/*
+ * The shared memory state table (see soundspace_shm.h), rewritten from a
+ * timer for monitors which never talk to us.
+ */
+class ShmState {
+    struct ss_state * st;
+    size_t size;
+    struct event timer_ev;
+    struct timeval tick;
+
+    static void copyTiming(struct ss_timing & to, Timing & from) {
+	to.count = from.count;
+	to.last = from.last;
+	to.max = from.max;
+	to.total = from.total;
+    }
+
+    static uint32_t playState(ALint state) {
+	switch (state) {
+	case AL_PLAYING: return SS_PLAYING;
+	case AL_PAUSED: return SS_PAUSED;
+	case AL_STOPPED: return SS_STOPPED;
+	}
+	return SS_INITIAL;
+    }
+
+public:
+    ShmState(const std::string & name, uint32_t max_sources, double tick_ms) {
+	size = ss_state_size(max_sources);
+	int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+	if (fd == -1) throw("could not create shared memory for state");
+	if (ftruncate(fd, size) == -1) {
+	    close(fd);
+	    throw("could not size shared memory for state");
+	}
+	st = (struct ss_state *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+				     MAP_SHARED, fd, 0);
+	close(fd);
+	if (st == MAP_FAILED) throw("could not map shared memory for state");
+
+	memset(st, 0, size);
+	st->version = SS_STATE_VERSION;
+	st->max_sources = max_sources;
+	__atomic_store_n(&st->magic, SS_STATE_MAGIC, __ATOMIC_RELEASE);
+
+	long usec = (long)(tick_ms * 1000.0);
+	if (usec < 100) usec = 100;
+	tick.tv_sec = usec / 1000000L;
+	tick.tv_usec = usec % 1000000L;
+	evtimer_set(&timer_ev, timer_cb, this);
+	evtimer_add(&timer_ev, &tick);
+    }
+
+    ~ShmState() {
+	evtimer_del(&timer_ev);
+	munmap(st, size);
+    }
+
+    void update() {
+	struct timespec now;
+	size_t i, n = dev->sources.size();
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (n > st->max_sources) n = st->max_sources;
+
+	ss_state_begin(st);
+	st->ticks++;
+	st->time = now.tv_sec + now.tv_nsec / 1e9;
+	st->nsources = dev->sources.size();
+	copyTiming(st->animator, stats.animator);
+	copyTiming(st->refill, stats.refill);
+	st->underruns = stats.underruns;
+	for (i = 0; i < n; i++) {
+	    Source * s = dev->sources[i];
+	    struct ss_source_state & o = st->sources[i];
+	    ALfloat * v = s->position();
+
+	    strncpy(o.name, s->name.c_str(), SS_STATE_NAME_LEN - 1);
+	    o.name[SS_STATE_NAME_LEN - 1] = '\0';
+	    o.position[0] = v[0];
+	    o.position[1] = v[1];
+	    o.position[2] = v[2];
+	    o.gain = s->gain();
+	    o.pitch = s->pitch();
+	    o.state = playState(s->state());
+	    o.underruns = s->underruns;
+	    o.offset = s->play_offset();
+	}
+	ss_state_end(st);
+    }
+
+    static void timer_cb(int, short, void * obj) {
+	ShmState * self = (ShmState*)obj;
+	try {
+	    self->update();
+	} catch (const char * s) {
+	    // never leave the table marked as being written
+	    if (self->st->seq & 1) ss_state_end(self->st);
+	    std::cerr << "error updating state table: '" << s << "'" << std::endl;
+	}
+	evtimer_add(&self->timer_ev, &self->tick);
+    }
+};
+
+ShmState * shm_state = NULL;
+
+void openShm() {
+    double tick = 5.0;
+    uint32_t max_sources = 256;
+
+    if (config.isMember("shm_tick_ms")) tick = config["shm_tick_ms"].asDouble();
+    if (config.isMember("shm_max_sources"))
+	max_sources = config["shm_max_sources"].asUInt();
+    try {
+	if (config.isMember("shm_commands"))
+	    shm_commands = new ShmCommands(config["shm_commands"].asString(),
+					   tick);
+	if (config.isMember("shm_state"))
+	    shm_state = new ShmState(config["shm_state"].asString(),
+				     max_sources, tick);
+    } catch (const char * s) {
+	std::cerr << "error: " << s << std::endl;
+    }
+}
+
+/*
+ * Open Sound Control input on a UDP port. Addresses are
+ *
+ *   /source/<name>/<command> args	name may be an OSC pattern
+ *   /listener/<position|velocity|orientation> floats
+ *   /json <command>			any json command
+ *   /<command> [ids...]		e.g. /stop_all, /play a.wav b.wav
+ *
+ * position, velocity, gain and pitch are applied directly, the rest goes
+ * through interpol_callback(). Bundles are applied in one AL update, and
+ * those with a time tag in the future are scheduled as a cue.
+ */
+struct OscSourceCommand {
+    const char * osc;
+    const char * cmd;
+    const char * args[2];
+};
+
+static const OscSourceCommand osc_source_commands[] = {
+    { "play", "play", { NULL, NULL } },
+    { "stop", "stop_audio", { NULL, NULL } },
+    { "pause", "pause", { NULL, NULL } },
+    { "rewind", "rewind", { NULL, NULL } },
+    { "seek", "seek", { "time", NULL } },
+    { "set_file", "set_file", { "file", "crossfade" } },
+    { "remove", "remove_source", { NULL, NULL } },
+    { "loop", "loop", { "loop", NULL } },
+    { "fade", "fade", { "time", "gain" } },
+    { "rotate", "rotate", { "speed", "time" } },
+    { "scale", "scale", { "speed", "time" } }
+};
+
+static bool oscArg(OscMessage & m, Json::Value & v) {
+    const char * s;
+    double d;
+    switch (m.peek()) {
+    case 's': case 'S':
+	if (!m.get(s)) return false;
+	v = s;
+	return true;
+    case 'T': case 'F':
+	v = m.peek() == 'T';
+	return m.skip();
+    }
+    if (!m.get(d)) return false;
+    v = d;
+    return true;
+}
+
+static void oscVector(OscMessage & m, ALfloat * v, unsigned int n) {
+    for (unsigned int i = 0; i < n; i++)
+	if (!m.get(v[i])) throw("bad OSC arguments. Expected floats.");
+}
+
+class OscInput : public OscHandler {
+    int fd;
+    struct event ev;
+    std::vector<Source*> targets;
+    std::string key;
+    Json::Value ids;
+
+    void resolve(const char * name, size_t n) {
+	targets.clear();
+	if (strcspn(name, "*?[{") < n) {
+	    for (size_t i = 0; i < dev->sources.size(); i++) {
+		std::string & sn = dev->sources[i]->name;
+		if (oscMatch(name, n, sn.data(), sn.size()))
+		    targets.push_back(dev->sources[i]);
+	    }
+	} else {
+	    key.assign(name, n);
+	    targets.push_back(dev->getSource(key));
+	}
+    }
+
+    void sourceMessage(const char * cmd, OscMessage & m) {
+	ALfloat v[3];
+	size_t i;
+
+	if (!strcmp(cmd, "position") || !strcmp(cmd, "velocity")) {
+	    bool pos = cmd[0] == 'p';
+	    oscVector(m, v, 3);
+	    for (i = 0; i < targets.size(); i++) {
+		if (pos) targets[i]->position(v);
+		else targets[i]->velocity(v);
+	    }
+	    return;
+	}
+	if (!strcmp(cmd, "gain") || !strcmp(cmd, "pitch")) {
+	    bool gain = cmd[0] == 'g';
+	    oscVector(m, v, 1);
+	    for (i = 0; i < targets.size(); i++) {
+		if (gain) targets[i]->gain(v[0]);
+		else targets[i]->pitch(v[0]);
+	    }
+	    return;
+	}
+
+	for (i = 0; i < sizeof(osc_source_commands)/sizeof(*osc_source_commands); i++) {
+	    const OscSourceCommand & c = osc_source_commands[i];
+	    if (strcmp(cmd, c.osc)) continue;
+
+	    Json::Value root;
+	    root["cmd"] = c.cmd;
+	    ids.clear();
+	    for (size_t k = 0; k < targets.size(); k++)
+		ids.append(targets[k]->name);
+	    root["ids"] = ids;
+	    for (int a = 0; a < 2 && c.args[a]; a++) {
+		if (!oscArg(m, root[c.args[a]]))
+		    throw("bad OSC arguments.");
+	    }
+	    interpol_callback(root);
+	    return;
+	}
+	throw("unknown OSC command");
+    }
+
+public:
+    unsigned long packets;
+    unsigned long errors;
+
+    OscInput(const char * host, int port) : packets(0), errors(0) {
+	struct sockaddr_in sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	if (!inet_aton(host, &sa.sin_addr)) throw("bad osc_host");
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) throw("could not create OSC socket");
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+	    close(fd);
+	    throw("could not bind OSC port");
+	}
+	event_set(&ev, fd, EV_READ | EV_PERSIST, read_cb, this);
+	event_add(&ev, NULL);
+    }
+
+    ~OscInput() {
+	event_del(&ev);
+	close(fd);
+    }
+
+    void message(OscMessage & m) {
+	const char * a = m.address;
+
+	try {
+	    if (!strncmp(a, "/source/", 8)) {
+		// names may contain slashes, the command is the last part
+		const char * cmd = strrchr(a + 8, '/');
+		if (!cmd || cmd == a + 8) throw("bad OSC address");
+		resolve(a + 8, cmd - (a + 8));
+		sourceMessage(cmd + 1, m);
+	    } else if (!strncmp(a, "/listener/", 10)) {
+		ALfloat v[6];
+		if (!strcmp(a + 10, "orientation")) {
+		    oscVector(m, v, 6);
+		    dev->l.orientation(v);
+		} else {
+		    oscVector(m, v, 3);
+		    if (!strcmp(a + 10, "position")) dev->l.position(v);
+		    else if (!strcmp(a + 10, "velocity")) dev->l.velocity(v);
+		    else throw("unknown OSC command");
+		}
+	    } else if (!strcmp(a, "/trigger")) {
+		// clip [x y z [gain]]
+		ALfloat v[3] = { 0.0f, 0.0f, 0.0f }, gain = 1.0f;
+		const char * clip;
+		if (!m.get(clip)) throw("bad OSC arguments. Expected clip.");
+		if (m.peek()) oscVector(m, v, 3);
+		if (m.peek() && !m.get(gain)) throw("bad OSC arguments.");
+		triggers.trigger(clip, strlen(clip), v, gain, 1.0f);
+	    } else if (!strcmp(a, "/json")) {
+		Json::Reader r;
+		Json::Value root;
+		const char * s;
+		if (!m.get(s) || !r.parse(s, root, false) || !root.isObject())
+		    throw("bad json in OSC message");
+		interpol_callback(root);
+	    } else {
+		Json::Value root;
+		root["cmd"] = a + 1;
+		while (m.peek()) {
+		    Json::Value v;
+		    if (!oscArg(m, v)) throw("bad OSC arguments.");
+		    root["ids"].append(v);
+		}
+		interpol_callback(root);
+	    }
+	} catch (const char * s) {
+	    errors++;
+	    std::cerr << "error in OSC message " << a << ": '" << s << "'"
+		      << std::endl;
+	}
+    }
+
+    // bundles take effect in the same AL update
+    void dispatch(const char * s, size_t n) {
+	OscTime t;
+	bool bundle = oscBundleTime(s, n, t);
+
+	if (bundle) alcSuspendContext(dev->ctx);
+	if (!oscDispatch(s, n, *this)) {
+	    errors++;
+	    std::cerr << "bad OSC packet" << std::endl;
+	}
+	if (bundle) alcProcessContext(dev->ctx);
+    }
+
+    void packet(const char * s, size_t n);
+
+    static void read_cb(int fd, short, void * obj) {
+	static char buf[65536];
+	OscInput * self = (OscInput*)obj;
+	ssize_t n;
+
+	while ((n = recv(fd, buf, sizeof(buf), 0)) >= 0) {
+	    self->packets++;
+	    self->packet(buf, n);
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+	    std::cerr << "error reading OSC socket: " << strerror(errno)
+		      << std::endl;
+    }
+};
+
+OscInput * osc_input = NULL;
+
+// a bundle with a time tag, waiting for its time
+class OscCue : public Cue {
+    std::string packet;
+public:
+    OscCue(double delay, const char * s, size_t n) : Cue(delay), packet(s, n) { }
+
+    void fire() {
+	if (osc_input) osc_input->dispatch(packet.data(), packet.size());
+    }
+
+    const char * toString() {
+	return "OscCue";
+    }
+};
+
+void OscInput::packet(const char * s, size_t n) {
+    OscTime t;
+
+    if (oscBundleTime(s, n, t) && t != OSC_IMMEDIATELY) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	double delay = oscUnixTime(t) - (now.tv_sec + now.tv_nsec / 1e9);
+	if (delay > 0.0) {
+	    dev->cues.add(new OscCue(delay, s, n));
+	    return;
+	}
+    }
+    dispatch(s, n);
+}
+
+void openOsc() {
+    std::string host = "127.0.0.1";
+
+    if (config.isMember("osc_host")) host = config["osc_host"].asString();
+    try {
+	osc_input = new OscInput(host.c_str(), config["osc_port"].asInt());
+    } catch (const char * s) {
+	std::cerr << "error: " << s << std::endl;
+    }
+}
+
+/*
+ * The http endpoint, for browsers and other web tools:
+ *
+ *   POST /command	commands, one per line, replies in the response
+ *   GET /ws		a websocket carrying the same json protocol, one
+ *			command or reply per text message. events of a
+ *			subscription are pushed.
+ */
+// queued bytes above which events are dropped for a websocket
+const size_t WS_LOW_LIMIT = 256 * 1024;
+// queued bytes above which a websocket is given up
+const size_t WS_LIMIT = 16 * 1024 * 1024;
+
+class WebSocket {
+    struct evhttp_connection * evcon;
+    struct bufferevent * bev;
+    std::string message;
+    std::string frame;
+    bool closing;
+
+    void send(int opcode, const char * s, size_t n) {
+	frame.clear();
+	wsFrame(frame, opcode, s, n);
+	bufferevent_write(bev, frame.data(), frame.size());
+    }
+
+    void close() {
+	// frees bev and the request which started it all
+	evhttp_connection_free(evcon);
+	delete this;
+    }
+
+    // after a close frame, wait until the reply went out
+    void shutdown() {
+	closing = true;
+	bufferevent_disable(bev, EV_READ);
+	bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+    }
+
+    // returns false when the connection is done
+    bool frames() {
+	struct evbuffer * in = bufferevent_get_input(bev);
+	size_t n;
+	WsFrame f;
+	long used;
+
+	while ((n = evbuffer_get_length(in))) {
+	    char * p = (char *)evbuffer_pullup(in, n);
+	    used = wsParse(p, n, f, Interpol::DEFAULT_MAX_MESSAGE);
+	    if (used == 0) break;
+	    if (used < 0) {
+		std::cerr << "bad websocket frame" << std::endl;
+		return false;
+	    }
+
+	    switch (f.opcode) {
+	    case WS_TEXT:
+	    case WS_BINARY:
+		message.assign(f.payload, f.length);
+		break;
+	    case WS_CONTINUATION:
+		message.append(f.payload, f.length);
+		if (message.size() > Interpol::DEFAULT_MAX_MESSAGE) return false;
+		break;
+	    case WS_PING:
+		send(WS_PONG, f.payload, f.length);
+		break;
+	    case WS_CLOSE:
+		send(WS_CLOSE, f.payload, f.length < 2 ? f.length : 2);
+		evbuffer_drain(in, used);
+		shutdown();
+		return true;
+	    }
+	    if (f.fin && (f.opcode == WS_TEXT || f.opcode == WS_BINARY
+			  || f.opcode == WS_CONTINUATION)) {
+		if (message.size()) client.handle(message.data(), message.size());
+		message.clear();
+	    }
+	    evbuffer_drain(in, used);
+	}
+	return true;
+    }
+
+public:
+    Interpol client;
+    unsigned long dropped;
+
+    WebSocket(struct evhttp_request * req)
+    : evcon(evhttp_request_get_connection(req)),
+      bev(evhttp_connection_get_bufferevent(evcon)), closing(false),
+      client(comm.name, interpol_callback), dropped(0)
+    {
+	client.seperator = '\n';
+	client.fast = fastCommand;
+	client.sink = sink;
+	client.sink_arg = this;
+
+	// take the connection away from evhttp
+	bufferevent_set_timeouts(bev, NULL, NULL);
+	bufferevent_setcb(bev, read_cb, write_cb, event_cb, this);
+	bufferevent_enable(bev, EV_READ | EV_WRITE);
+	if (!frames()) close();
+    }
+
+    static void sink(void * o, const char * s, size_t n, OutQueue::priority p) {
+	WebSocket * ws = (WebSocket*)o;
+	size_t queued = evbuffer_get_length(bufferevent_get_output(ws->bev));
+
+	if (ws->closing) return;
+	if (queued > WS_LIMIT || (p == OutQueue::LOW && queued > WS_LOW_LIMIT)) {
+	    ws->dropped++;
+	    return;
+	}
+	if (n && s[n-1] == ws->client.seperator) n--;
+	ws->send(WS_TEXT, s, n);
+    }
+
+    static void read_cb(struct bufferevent *, void * o) {
+	WebSocket * ws = (WebSocket*)o;
+	if (!ws->frames()) ws->close();
+    }
+
+    static void write_cb(struct bufferevent *, void * o) {
+	WebSocket * ws = (WebSocket*)o;
+	if (ws->closing) ws->close();
+    }
+
+    static void event_cb(struct bufferevent *, short, void * o) {
+	// eof, errors and timeouts all end the connection
+	((WebSocket*)o)->close();
+    }
+};
+
+// a browser sends the origin of the page the request comes from, and any
+// page may talk to localhost. only those in http_origins are let through.
+// other clients send no origin.
+static bool originAllowed(const char * origin) {
+    if (!origin) return true;
+    for (Json::Value::ArrayIndex i = 0; i < http_origins.size(); i++) {
+	if (http_origins[i].asString() == origin) return true;
+    }
+    std::cerr << "refused http request from origin '" << origin << "'"
+	      << std::endl;
+    return false;
+}
+
+static void httpCommand(struct evhttp_request * req, void *) {
+    struct evkeyvalq * headers = evhttp_request_get_output_headers(req);
+    struct evbuffer * body = evhttp_request_get_input_buffer(req);
+    struct evbuffer * reply;
+    const char * origin = evhttp_find_header(evhttp_request_get_input_headers(req),
+					     "Origin");
+
+    // a form can post without asking first, so not sending the header is
+    // not enough
+    if (!originAllowed(origin)) {
+	evhttp_send_error(req, 403, "Forbidden");
+	return;
+    }
+    // browsers ask before posting json to another origin
+    if (origin) {
+	evhttp_add_header(headers, "Access-Control-Allow-Origin", origin);
+	evhttp_add_header(headers, "Vary", "Origin");
+    }
+    if (evhttp_request_get_command(req) == EVHTTP_REQ_OPTIONS) {
+	evhttp_add_header(headers, "Access-Control-Allow-Methods", "POST");
+	evhttp_add_header(headers, "Access-Control-Allow-Headers", "Content-Type");
+	evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+	return;
+    }
+    if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
+	evhttp_send_error(req, 405, "Method Not Allowed");
+	return;
+    }
+
+    std::istringstream in(std::string((const char *)evbuffer_pullup(body, -1),
+				      evbuffer_get_length(body)));
+    std::ostringstream out;
+    Interpol c(comm.name, interpol_callback, in, out);
+    c.seperator = '\n';
+    c.fast = fastCommand;
+    c.read();
+
+    reply = evbuffer_new();
+    evbuffer_add(reply, out.str().data(), out.str().size());
+    evhttp_add_header(headers, "Content-Type", "application/json");
+    evhttp_send_reply(req, HTTP_OK, "OK", reply);
+    evbuffer_free(reply);
+}
+
+static void httpWebSocket(struct evhttp_request * req, void *) {
+    struct evkeyvalq * in = evhttp_request_get_input_headers(req);
+    struct evkeyvalq * out = evhttp_request_get_output_headers(req);
+    const char * key = evhttp_find_header(in, "Sec-WebSocket-Key");
+    const char * upgrade = evhttp_find_header(in, "Upgrade");
+
+    if (!key || !upgrade || strcasecmp(upgrade, "websocket")) {
+	evhttp_send_error(req, HTTP_BADREQUEST, "Expected a websocket");
+	return;
+    }
+    // websockets are not bound by the same origin policy
+    if (!originAllowed(evhttp_find_header(in, "Origin"))) {
+	evhttp_send_error(req, 403, "Forbidden");
+	return;
+    }
+    evhttp_add_header(out, "Upgrade", "websocket");
+    evhttp_add_header(out, "Connection", "Upgrade");
+    evhttp_add_header(out, "Sec-WebSocket-Accept", wsAccept(key).c_str());
+    // no body follows a 101, so evhttp writes just the header
+    evhttp_send_reply_start(req, 101, "Switching Protocols");
+    new WebSocket(req);
+}
+
+struct evhttp * http = NULL;
+
+void openHttp() {
+    std::string host = "127.0.0.1";
+
+    if (config.isMember("http_host")) host = config["http_host"].asString();
+    http = evhttp_start(host.c_str(), config["http_port"].asUInt());
+    if (!http) {
+	std::cerr << "error: could not start http on " << host << ":"
+		  << config["http_port"].asUInt() << std::endl;
+	return;
+    }
+    evhttp_set_max_body_size(http, Interpol::DEFAULT_MAX_MESSAGE);
+    evhttp_set_allowed_methods(http, EVHTTP_REQ_GET | EVHTTP_REQ_POST
+			       | EVHTTP_REQ_OPTIONS);
+    evhttp_set_cb(http, "/command", httpCommand, NULL);
+    evhttp_set_cb(http, "/ws", httpWebSocket, NULL);
+}
+
+// seconds from now until a command with "at" (unix time) and/or "delay"
+// (seconds) is due.
+double cueDelay(Json::Value & root) {
+    double d = 0.0;
+
+    if (root.isMember("delay")) {
+	if (!root["delay"].isNumeric())
+	    throw("bad delay. expected seconds.");
+	d = root["delay"].asDouble();
+    }
+
+    if (root.isMember("at")) {
+	struct timespec now;
+	if (!root["at"].isNumeric())
+	    throw("bad at. expected unix time in seconds.");
+	clock_gettime(CLOCK_REALTIME, &now);
+	d += root["at"].asDouble() - (now.tv_sec + now.tv_nsec * 1E-9);
+    }
+
+    return d;
+}
+
+// cues are either given inline as "cues" : [ { "t" : 1.5, "cmd" : ... } ]
+// or as a script file with one '<seconds> <json command>' per line. times
+// are relative to the start of the cue.
+void loadCues(Json::Value & root, double start) {
+    if (root.isMember("cues")) {
+	Json::Value & cues = root["cues"];
+	Json::Value::ArrayIndex i;
+
+	if (!cues.isArray())
+	    throw("bad cues. expected array.");
+
+	for (i = 0; i < cues.size(); i++) {
+	    Json::Value c = cues[i];
+	    double t = 0.0;
+	    if (c.isMember("t")) {
+		if (!c["t"].isNumeric())
+		    throw("bad cue time. expected seconds.");
+		t = c["t"].asDouble();
+		c.removeMember("t");
+	    }
+	    dev->cues.add(start + t, c);
+	}
+    } else if (root["script"].isString()) {
+	std::string file = script_path + root["script"].asString();
+	std::ifstream script(file.c_str());
+	std::string line;
+	Json::Reader r;
+	size_t n = 0;
+
+	if (script.fail())
+	    throw("could not open cue file");
+
+	while (std::getline(script, line)) {
+	    const char * p = line.c_str();
+	    char * end;
+	    Json::Value c;
+	    double t;
+
+	    n++;
+	    while (isspace(*p)) p++;
+	    if (!*p || *p == '#') continue;
+
+	    t = strtod(p, &end);
+	    if (end == p || !r.parse(end, line.c_str() + line.size(), c, false)
+		|| !c.isObject()) {
+		std::cerr << "bad cue in " << file << " line " << n << std::endl;
+		continue;
+	    }
+	    dev->cues.add(start + t, c);
+	}
+    } else throw("bad cue. expected cues or script.");
+}
+
+// the client whose command is being handled
+static Interpol * client() {
+    return Interpol::current ? Interpol::current : &comm;
+}
+
+// the levels of s, zero for sources which are not playing
+static void addMeters(JSONBuilder & msg, Source * s) {
+    const float * l = s->levels();
+    unsigned int channels = s->buffer && s->buffer->loaded()
+			    ? s->buffer->channels : 1;
+
+    msg.object();
+    msg.key("id");
+    msg.add(s->name);
+    for (unsigned int k = 0; k < 2; k++) {
+	msg.key(k ? "rms" : "peak");
+	msg.array();
+	for (unsigned int ch = 0; ch < channels; ch++)
+	    msg.add(l ? l[2 * ch + k] : 0.0f);
+	msg.end();
+    }
+    msg.end();
+}
+
+// reply with the levels of the sources in "ids", or all of them. the
+// first call switches metering on, so until the queued chunks came round
+// the levels may be zero.
+void meters(Json::Value & root) {
+    static JSONBuilder msg;
+    static std::vector<Source*> a;
+
+    metering = metering_asked = true;
+    a.clear();
+    if (root.isMember("ids")) {
+	dev->Ids2Sources(root["ids"], a);
+    } else {
+	a = dev->sources;
+    }
+
+    msg.clear();
+    msg.object();
+    msg.key("src");
+    msg.add(comm.name);
+    msg.key("cmd");
+    msg.add("meters");
+    msg.key("sources");
+    msg.array();
+    for (size_t k = 0; k < a.size(); k++) addMeters(msg, a[k]);
+    msg.end();
+
+    client()->send_reply(msg);
+}
+
+// pushes the levels of the playing sources every interval to the clients
+// subscribed to "meters". a client which can not keep up only gets the
+// latest levels.
+class MeterPush {
+    struct event timer_ev;
+    bool timer_set;
+
+    void timer_continue() {
+	const struct timeval t = { meter_interval_ms / 1000,
+				   meter_interval_ms % 1000 * 1000 };
+	if (!timer_set && (Interpol::all_events & NOTIFY_METERS)) {
+	    evtimer_add(&timer_ev, &t);
+	    timer_set = true;
+	}
+    }
+
+    void push() {
+	static JSONBuilder msg;
+	std::list<Interpol*>::iterator it;
+
+	for (it = Interpol::clients.begin(); it != Interpol::clients.end(); it++) {
+	    Interpol * c = *it;
+	    unsigned int n = 0;
+	    if (!(c->events & NOTIFY_METERS)) continue;
+
+	    msg.clear();
+	    msg.object();
+	    msg.key("src");
+	    msg.add(comm.name);
+	    msg.key("cmd");
+	    msg.add("event");
+	    msg.key("event");
+	    msg.add("meters");
+	    msg.key("sources");
+	    msg.array();
+	    for (size_t k = 0; k < dev->sources.size(); k++) {
+		Source * s = dev->sources[k];
+		if (c->event_ids.size() && !c->event_ids.count(s->name)) continue;
+		if (!s->levels()) continue;
+		addMeters(msg, s);
+		n++;
+	    }
+	    msg.end();
+	    msg.end();
+	    if (n) c->send_message(msg.buf, OutQueue::LOW, "meters");
+	}
+    }
+
+    static void timer_cb(int, short, void * o) {
+	MeterPush * self = (MeterPush*)o;
+	self->timer_set = false;
+	if (dev) self->push();
+	self->timer_continue();
+    }
+
+public:
+    MeterPush() : timer_set(false) {}
+
+    // after a subscription, until nobody is subscribed any more
+    void start() {
+	metering = metering_asked = true;
+	if (!timer_set) evtimer_set(&timer_ev, timer_cb, this);
+	timer_continue();
+    }
+} meter_push;
+
+// (un)subscribe the current client to "events" (all if missing), and
+// limit them to the sources in "ids" if given.
+void subscribe(Json::Value & root, bool on) {
+    Interpol * c = client();
+    Json::Value & events = root["events"];
+    unsigned int mask = 0;
+
+    if (events.isNull()) {
+	mask = on ? NOTIFY_ALL : NOTIFY_ALL | NOTIFY_METERS;
+    } else if (events.isString()) {
+	mask = notifyEvent(events.asString());
+    } else if (events.isArray()) {
+	for (Json::Value::ArrayIndex i = 0; i < events.size(); i++)
+	    mask |= notifyEvent(events[i].asString());
+    } else throw("bad events. expected string or array.");
+
+    if (!on) {
+	c->unsubscribe(mask);
+	return;
+    }
+
+    if (root.isMember("ids")) {
+	Json::Value & ids = root["ids"];
+	c->event_ids.clear();
+	if (!ids.isBool() || !ids.asBool()) {
+	    std::vector<Source*> a;
+	    dev->Ids2Sources(ids, a);
+	    for (size_t i = 0; i < a.size(); i++)
+		c->event_ids.insert(a[i]->name);
+	}
+    }
+    c->subscribe(mask);
+    if (mask & NOTIFY_METERS) meter_push.start();
+}
+
+enum {
+    QUERY_POSITION = 1 << 0,
+    QUERY_GAIN = 1 << 1,
+    QUERY_PITCH = 1 << 2,
+    QUERY_STATE = 1 << 3,
+    QUERY_OFFSET = 1 << 4,
+    QUERY_HANDLE = 1 << 5,
+    QUERY_FRAME = 1 << 6,
+    QUERY_ALL = (1 << 7) - 1
+};
+
+static const char * query_fields[] = {
+    "position", "gain", "pitch", "state", "offset", "handle", "frame"
+};
+
+static const char * stateName(ALint state) {
+    switch (state) {
+    case AL_INITIAL: return "initial";
+    case AL_PLAYING: return "playing";
+    case AL_PAUSED: return "paused";
+    case AL_STOPPED: return "stopped";
+    }
+    return "unknown";
+}
+
+// reply with the state of many sources at once. the reply is written
+// straight into a reused buffer instead of building a Json::Value.
+void query(Json::Value & root) {
+    static JSONBuilder msg;
+    static std::vector<Source*> a;
+    Json::Value & fields = root["fields"];
+    unsigned int mask = 0, i;
+
+    if (fields.isNull()) {
+	mask = QUERY_ALL;
+    } else if (fields.isArray()) {
+	for (Json::Value::ArrayIndex j = 0; j < fields.size(); j++) {
+	    std::string f = fields[j].asString();
+	    for (i = 0; i < sizeof(query_fields)/sizeof(*query_fields); i++) {
+		if (f == query_fields[i]) break;
+	    }
+	    if (i == sizeof(query_fields)/sizeof(*query_fields))
+		throw("unknown query field");
+	    mask |= 1 << i;
+	}
+    } else throw("bad fields. expected array.");
+
+    a.clear();
+    if (root.isMember("ids")) {
+	dev->Ids2Sources(root["ids"], a);
+    } else {
+	a = dev->sources;
+    }
+
+    msg.clear();
+    msg.object();
+    msg.key("src");
+    msg.add(comm.name);
+    msg.key("cmd");
+    msg.add("query");
+    msg.key("sources");
+    msg.array();
+
+    for (size_t k = 0; k < a.size(); k++) {
+	Source * s = a[k];
+	msg.object();
+	msg.key("id");
+	msg.add(s->name);
+	if (mask & QUERY_POSITION) {
+	    ALfloat * v = s->position();
+	    msg.key("position");
+	    msg.array();
+	    msg.add(v[0]);
+	    msg.add(v[1]);
+	    msg.add(v[2]);
+	    msg.end();
+	}
+	if (mask & QUERY_GAIN) {
+	    msg.key("gain");
+	    msg.add(s->gain());
+	}
+	if (mask & QUERY_PITCH) {
+	    msg.key("pitch");
+	    msg.add(s->pitch());
+	}
+	if (mask & QUERY_STATE) {
+	    msg.key("state");
+	    msg.add(stateName(s->state()));
+	}
+	if (mask & QUERY_OFFSET) {
+	    msg.key("offset");
+	    msg.add(s->play_offset());
+	}
+	if (mask & QUERY_FRAME) {
+	    msg.key("frame");
+	    msg.add((unsigned long)s->play_frame());
+	}
+	if (mask & QUERY_HANDLE) {
+	    // the index into sources, as used by the shared memory commands
+	    msg.key("handle");
+	    msg.add((unsigned long)(std::find(dev->sources.begin(),
+				   dev->sources.end(), s) - dev->sources.begin()));
+	}
+	msg.end();
+    }
+    msg.end();
+
+    client()->send_reply(msg);
+}
+
+static void addTiming(JSONBuilder & msg, const char * name, Timing & t) {
+    msg.key(name);
+    msg.object();
+    msg.key("count");
+    msg.add(t.count);
+    msg.key("last_us");
+    msg.add(t.last);
+    msg.key("max_us");
+    msg.add(t.max);
+    msg.key("avg_us");
+    msg.add(t.count ? t.total / t.count : 0.0);
+    msg.end();
+}
+
+// timings and counters of the whole process
+void sendStats() {
+    static JSONBuilder msg;
+
+    msg.clear();
+    msg.object();
+    msg.key("src");
+    msg.add(comm.name);
+    msg.key("cmd");
+    msg.add("stats");
+    addTiming(msg, "animator", stats.animator);
+    addTiming(msg, "refill", stats.refill);
+    addTiming(msg, "convert", stats.convert);
+    msg.key("convert_mb_per_s");
+    msg.add(stats.convert.total > 0.0 ? stats.convert_bytes / stats.convert.total : 0.0);
+    addTiming(msg, "resample", stats.resample);
+    addTiming(msg, "decode", stats.decode);
+    msg.key("decode_mb_per_s");
+    msg.add(stats.decode.total > 0.0 ? stats.decode_bytes / stats.decode.total : 0.0);
+    addTiming(msg, "meter", stats.meter);
+    msg.key("underruns");
+    msg.add(stats.underruns);
+    msg.key("sources");
+    msg.add((unsigned long)dev->sources.size());
+    msg.key("cues");
+    msg.add((unsigned long)dev->cues.size());
+    msg.key("open_files");
+    msg.add((unsigned long)buffer_cache.open_files);
+    msg.key("mapped");
+    msg.add((unsigned long)buffer_cache.mapped);
+    msg.key("al_sources");
+    msg.add((unsigned long)buffer_cache.sources);
+    msg.key("triggers");
+    msg.object();
+    msg.key("voices");
+    msg.add((unsigned long)triggers.voices);
+    msg.key("active");
+    msg.add((unsigned long)triggers.active());
+    msg.key("triggered");
+    msg.add(triggers.triggered);
+    msg.key("stolen");
+    msg.add(triggers.stolen);
+    msg.end();
+    msg.key("resident");
+    msg.add((unsigned long)residency.resident);
+    msg.key("prefetched_mb");
+    msg.add(stats.prefetched / 1048576.0);
+    msg.key("released_mb");
+    msg.add(stats.released / 1048576.0);
+    msg.key("major_faults");
+    msg.add(stats.major_faults);
+    msg.key("minor_faults");
+    msg.add(stats.minor_faults);
+    if (comm.oq) {
+	msg.key("output");
+	msg.object();
+	msg.key("queued");
+	msg.add((unsigned long)comm.oq->queued);
+	msg.key("writes");
+	msg.add(comm.oq->writes);
+	msg.key("dropped");
+	msg.add(comm.oq->dropped);
+	msg.key("collapsed");
+	msg.add(comm.oq->collapsed);
+	msg.end();
+    }
+    if (osc_input) {
+	msg.key("osc");
+	msg.object();
+	msg.key("packets");
+	msg.add(osc_input->packets);
+	msg.key("errors");
+	msg.add(osc_input->errors);
+	msg.end();
+    }
+    if (shm_commands) {
+	msg.key("shm_commands");
+	msg.object();
+	msg.key("applied");
+	msg.add(shm_commands->applied);
+	msg.key("dropped");
+	msg.add(shm_commands->dropped());
+	msg.end();
+    }
+
+    client()->send_reply(msg);
+}
+
+const unsigned int MAX_FAST_IDS = 64;
+
+// a hot command as read by the fast parser
+struct FastCommand {
+    enum { NONE, POSITION, VELOCITY, GAIN, PITCH, LISTENER, TRIGGER } cmd;
+    enum { HAS_POSITION = 1, HAS_VELOCITY = 2, HAS_ORIENTATION = 4,
+	   HAS_GAIN = 8, HAS_PITCH = 16, HAS_CLIP = 32 };
+    unsigned int has;
+    ALfloat position[3], velocity[3], orientation[6];
+    ALfloat gain, pitch;
+    const char * clip;
+    size_t clip_len;
+    bool all;
+    unsigned int nids;
+    const char * ids[MAX_FAST_IDS];
+    size_t id_len[MAX_FAST_IDS];
+    // numeric ids leave ids[i] NULL
+    double id_num[MAX_FAST_IDS];
+};
+
+static bool fastVector(FastJSON & j, ALfloat * v, unsigned int n) {
+    unsigned int got;
+    return j.numbers(v, n, got) && got == n;
+}
+
+static bool fastIds(FastJSON & j, FastCommand & c) {
+    switch (j.peek()) {
+    case FastJSON::T_STRING:
+	c.nids = 1;
+	return j.string(c.ids[0], c.id_len[0]);
+    case FastJSON::T_NUMBER:
+	c.nids = 1;
+	c.ids[0] = NULL;
+	return j.number(c.id_num[0]);
+    case FastJSON::T_BOOL:
+	return j.boolean(c.all) && c.all;
+    case FastJSON::T_ARRAY:
+	return j.strings(c.ids, c.id_len, MAX_FAST_IDS, c.nids) && c.nids;
+    default:
+	return false;
+    }
+}
+
+/*
+ * Handles position, velocity, gain, pitch, listener updates and triggers
+ * without building a Json::Value. Anything unexpected, including unknown sources,
+ * returns false and goes the normal way, which also reports the errors.
+ */
+bool fastCommand(const char * s, size_t n) {
+    static std::vector<Source*> targets;
+    static std::string key;
+    FastJSON j(s, n);
+    FastCommand c;
+    const char * k, * v;
+    size_t kn, vn;
+    unsigned int i;
+    int r;
+
+    c.cmd = FastCommand::NONE;
+    c.has = 0;
+    c.all = false;
+    c.nids = 0;
+
+    if (!dev || !j.begin()) return false;
+
+    while ((r = j.next(k, kn)) > 0) {
+	if (FastJSON::is(k, kn, "cmd")) {
+	    if (!j.string(v, vn)) return false;
+	    if (FastJSON::is(v, vn, "position")) c.cmd = FastCommand::POSITION;
+	    else if (FastJSON::is(v, vn, "velocity")) c.cmd = FastCommand::VELOCITY;
+	    else if (FastJSON::is(v, vn, "gain")) c.cmd = FastCommand::GAIN;
+	    else if (FastJSON::is(v, vn, "pitch")) c.cmd = FastCommand::PITCH;
+	    else if (FastJSON::is(v, vn, "listener")) c.cmd = FastCommand::LISTENER;
+	    else if (FastJSON::is(v, vn, "trigger")) c.cmd = FastCommand::TRIGGER;
+	    else return false;
+	} else if (FastJSON::is(k, kn, "id") || FastJSON::is(k, kn, "ids")) {
+	    if (c.nids || c.all || !fastIds(j, c)) return false;
+	} else if (FastJSON::is(k, kn, "clip")) {
+	    if (!j.string(c.clip, c.clip_len)) return false;
+	    c.has |= FastCommand::HAS_CLIP;
+	} else if (FastJSON::is(k, kn, "position")) {
+	    if (!fastVector(j, c.position, 3)) return false;
+	    c.has |= FastCommand::HAS_POSITION;
+	} else if (FastJSON::is(k, kn, "velocity")) {
+	    if (!fastVector(j, c.velocity, 3)) return false;
+	    c.has |= FastCommand::HAS_VELOCITY;
+	} else if (FastJSON::is(k, kn, "orientation")) {
+	    if (!fastVector(j, c.orientation, 6)) return false;
+	    c.has |= FastCommand::HAS_ORIENTATION;
+	} else if (FastJSON::is(k, kn, "gain")) {
+	    if (!j.number(c.gain)) return false;
+	    c.has |= FastCommand::HAS_GAIN;
+	} else if (FastJSON::is(k, kn, "pitch")) {
+	    if (!j.number(c.pitch)) return false;
+	    c.has |= FastCommand::HAS_PITCH;
+	} else return false;
+    }
+    if (r < 0 || !j.done()) return false;
+
+    if (c.cmd == FastCommand::LISTENER) {
+	if (c.nids || c.all || !c.has) return false;
+	if (c.has & FastCommand::HAS_ORIENTATION) dev->l.orientation(c.orientation);
+	if (c.has & FastCommand::HAS_POSITION) dev->l.position(c.position);
+	if (c.has & FastCommand::HAS_VELOCITY) dev->l.velocity(c.velocity);
+	return true;
+    }
+
+    if (c.cmd == FastCommand::TRIGGER) {
+	if (c.nids || c.all || c.has != (c.has & (FastCommand::HAS_CLIP
+		| FastCommand::HAS_POSITION | FastCommand::HAS_GAIN
+		| FastCommand::HAS_PITCH)) || !(c.has & FastCommand::HAS_CLIP)
+	    || !triggers.has(c.clip, c.clip_len))
+	    return false;
+	if (!(c.has & FastCommand::HAS_POSITION))
+	    c.position[0] = c.position[1] = c.position[2] = 0.0f;
+	if (!(c.has & FastCommand::HAS_GAIN)) c.gain = 1.0f;
+	if (!(c.has & FastCommand::HAS_PITCH)) c.pitch = 1.0f;
+	try {
+	    triggers.trigger(c.clip, c.clip_len, c.position, c.gain, c.pitch);
+	} catch (const char * e) {
+	    std::cerr << "error in fast command: '" << e << "'" << std::endl;
+	}
+	return true;
+    }
+
+    switch (c.cmd) {
+    case FastCommand::POSITION:
+	if (!(c.has & FastCommand::HAS_POSITION)) return false;
+	break;
+    case FastCommand::VELOCITY:
+	if (!(c.has & FastCommand::HAS_VELOCITY)) return false;
+	break;
+    case FastCommand::GAIN:
+	if (!(c.has & FastCommand::HAS_GAIN)) return false;
+	break;
+    case FastCommand::PITCH:
+	if (!(c.has & FastCommand::HAS_PITCH)) return false;
+	break;
+    default:
+	return false;
+    }
+
+    // resolve all targets before touching any of them
+    targets.clear();
+    if (c.all) {
+	targets = dev->sources;
+    } else if (!c.nids) {
+	return false;
+    }
+    for (i = 0; i < c.nids; i++) {
+	Source * src;
+	if (c.ids[i]) {
+	    key.assign(c.ids[i], c.id_len[i]);
+	    src = dev->findSource(key);
+	} else {
+	    if (c.id_num[i] < 0 || c.id_num[i] >= dev->sources.size())
+		return false;
+	    src = dev->sources[(size_t)c.id_num[i]];
+	}
+	if (!src) return false;
+	targets.push_back(src);
+    }
+
+    try {
+	for (i = 0; i < targets.size(); i++) {
+	    Source * src = targets[i];
+	    switch (c.cmd) {
+	    case FastCommand::POSITION: src->position(c.position); break;
+	    case FastCommand::VELOCITY: src->velocity(c.velocity); break;
+	    case FastCommand::GAIN: src->gain(c.gain); break;
+	    case FastCommand::PITCH: src->pitch(c.pitch); break;
+	    default: break;
+	    }
+	}
+    } catch (const char * e) {
+	std::cerr << "error in fast command: '" << e << "'" << std::endl;
+    }
+    return true;
+}
+
+void interpol_callback(Json::Value & root) {
+    try {
+	if (root["cmd"] == "cue") {
+	    loadCues(root, cueDelay(root));
+	} else if (root["cmd"] == "play" && (root.isMember("at")
+					     || root.isMember("delay"))) {
+	    dev->Play(root["ids"], cueDelay(root));
+	} else if (root.isMember("at") || root.isMember("delay")) {
+	    dev->cues.add(cueDelay(root), root);
+	} else if (root["cmd"] == "clear_cues") {
+	    dev->cues.clear();
+	} else if (root["cmd"] == "play") {
+	    dev->Play(root["ids"]);
+	} else if (root["cmd"] == "eval") {
+	    if (!root["script"].isString()) {
+		throw("bad script file. expected string.");
+	    }
+	    std::string file = script_path;
+	    std::cerr << "script_path: " << script_path << std::endl;
+	    file.append(root["script"].asCString());
+	    client()->eval(file);
+	} else if (root["cmd"] == "add_source") {
+	    Source * s = sourceFromJSON(root);
+	    if (s) dev->snapshot.push_back(s->copy());
+	} else if (root["cmd"] == "remove_source") {
+	    dev->removeSources(root["ids"]);
+	} else if (root["cmd"] == "stop_audio") {
+	    dev->Stop(root["ids"]);
+	} else if (root["cmd"] == "reset_audio") {
+	    dev->StopAll();
+	    dev->applySnapshot();
+	} else if (root["cmd"] == "stop_all") {
+	    dev->StopAll();
+	} else if (root["cmd"] == "pause") {
+	    dev->Pause(root["ids"]);
+	} else if (root["cmd"] == "rewind") {
+	    dev->Rewind(root["ids"]);
+	} else if (root["cmd"] == "seek") {
+	    dev->Seek(root["ids"], root);
+	} else if (root["cmd"] == "set_file") {
+	    setFile(root["ids"], root);
+	} else if (root["cmd"] == "trigger") {
+	    triggerClip(root);
+	} else if (root["cmd"] == "position") {
+	    if (root.isMember("ids")) 
+		dev->position(root["ids"], root["position"]);
+	    else 
+		dev->getSource(root["id"])->position(root["position"]);
+	} else if (root["cmd"] == "gain") {
+	    if (root.isMember("ids"))
+		dev->gain(root["ids"], root["gain"]);
+	    else
+		dev->getSource(root["id"])->gain(root["gain"]);
+	} else if (root["cmd"] == "pitch") {
+	    if (root.isMember("ids"))
+		dev->pitch(root["ids"], root["pitch"]);
+	    else
+		dev->getSource(root["id"])->pitch(root["pitch"]);
+	} else if (root["cmd"] == "velocity") {
+	    if (root.isMember("ids"))
+		dev->velocity(root["ids"], root["velocity"]);
+	    else
+		dev->getSource(root["id"])->velocity(root["velocity"]);
+	} else if (root["cmd"] == "listener") {
+	    configureListener(root);
+	} else if (root["cmd"] == "fade") {
+	    dev->Fade(root["ids"], root["time"], root["gain"]);
+	} else if (root["cmd"] == "scale") {
+	    dev->Scale(root["ids"], root["time"], root["speed"]);
+	} else if (root["cmd"] == "rotate") {
+	    dev->Rotate(root["ids"], root["time"], root["speed"]);
+	} else if (root["cmd"] == "pause_all") {
+	    dev->PauseAll();
+	} else if (root["cmd"] == "continue_all") {
+	    dev->ContinueAll();
+	} else if (root["cmd"] == "loop") {
+	    // loop points may be changed without touching the loop flag
+	    bool points = false;
+	    if (root.isMember("loop_start")) {
+		dev->loop_start(root["ids"], root["loop_start"]);
+		points = true;
+	    }
+	    if (root.isMember("loop_end")) {
+		dev->loop_end(root["ids"], root["loop_end"]);
+		points = true;
+	    }
+	    if (root.isMember("loop_crossfade")) {
+		dev->loop_crossfade(root["ids"], root["loop_crossfade"]);
+		points = true;
+	    }
+	    if (root.isMember("loop") || !points)
+		dev->loop(root["ids"], root["loop"]);
+	} else if (root["cmd"] == "stats") {
+	    sendStats();
+	} else if (root["cmd"] == "query") {
+	    query(root);
+	} else if (root["cmd"] == "meters") {
+	    meters(root);
+	} else if (root["cmd"] == "subscribe") {
+	    subscribe(root, true);
+	} else if (root["cmd"] == "unsubscribe") {
+	    subscribe(root, false);
+	} else if (root["cmd"] == "reload") {
+	    reload();
+	} else if (root["cmd"] == "die_audio") {
+	    shutdown(1, "dying");
+	} else {
+	    throw("unknown command");
+	}
+    } catch (const char * s) {
+	std::cerr << "error in " << root["cmd"].asString() << ": '"
+		  << s << "'" << std::endl;
+	client()->send_error(s);
+    } catch (...) {
+	std::cerr << "unknown error in " << root["cmd"].asString() << std::endl;
+	client()->send_error("generic");
+    }
+}
+
+int main(int argc, char ** argv) {
+    struct event ev;
+
+    event_init();
+#ifdef TESTING
+    comm.seperator = '\n';
 #endif
+    OutQueue output(1);
+    comm.oq = &output;
+    comm.fast = fastCommand;
     setup();
 
+    if (config.isMember("watch_config") && config["watch_config"].asBool())
+	watchConfig();
+
+    openShm();
+
+    if (config.isMember("osc_port"))
+	openOsc();
+
+    if (config.isMember("http_port"))
+	openHttp();
+
     comm.send_command("ready");
 
     signal(SIGINT, shutdown);
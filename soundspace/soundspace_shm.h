@@ -0,0 +1,247 @@
+#ifndef SOUNDSPACE_SHM_H
+#define SOUNDSPACE_SHM_H
+
+/*
+ * Shared memory command ring of soundspace, for controllers running on the
+ * same host which send updates at high rates. soundspace creates the ring
+ * under the name given as "shm_commands" in its configuration and drains
+ * it every "shm_tick_ms". Any number of processes may push commands, no
+ * locks or system calls are involved.
+ *
+ *   struct ss_cmd_ring * r = ss_cmd_open("/soundspace");
+ *   struct ss_cmd c = { SS_CMD_POSITION, 3, { 1.0f, 0.0f, -2.0f } };
+ *   if (!ss_cmd_push(r, &c)) ... the ring is full, try again later
+ *
+ * Handles are the index of a source, as returned in "handle" by query.
+ * Needs gcc or clang for the __atomic builtins.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SS_CMD_MAGIC	0x53534331	/* "SSC1" */
+#define SS_CMD_VERSION	1
+#define SS_CMD_SLOTS	1024		/* a power of two */
+
+enum ss_cmd_op {
+    SS_CMD_NOP = 0,
+    SS_CMD_POSITION,		/* v[0..2] */
+    SS_CMD_VELOCITY,		/* v[0..2] */
+    SS_CMD_GAIN,		/* v[0] */
+    SS_CMD_PITCH,		/* v[0] */
+    SS_CMD_LISTENER_POSITION,	/* v[0..2], handle is ignored */
+    SS_CMD_LISTENER_VELOCITY,	/* v[0..2], handle is ignored */
+    SS_CMD_LISTENER_ORIENTATION	/* v[0..5], at and up */
+};
+
+struct ss_cmd {
+    uint32_t op;
+    uint32_t handle;
+    float v[6];
+};
+
+struct ss_cmd_slot {
+    /* equals the position the slot is free for, or that plus one when
+     * it holds a command */
+    uint32_t seq;
+    uint32_t pad;
+    struct ss_cmd cmd;
+};
+
+struct ss_cmd_ring {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t dropped;		/* pushes which found the ring full */
+    char pad0[48];
+    uint32_t tail;		/* next position to push to */
+    char pad1[60];
+    uint32_t head;		/* next position to take, soundspace only */
+    char pad2[60];
+    struct ss_cmd_slot ring[SS_CMD_SLOTS];
+};
+
+/* returns 0 when the ring is full */
+static inline int ss_cmd_push(struct ss_cmd_ring * r, const struct ss_cmd * c) {
+    struct ss_cmd_slot * s;
+    uint32_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    int32_t d;
+
+    for (;;) {
+	s = &r->ring[pos & (SS_CMD_SLOTS - 1)];
+	d = (int32_t)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - pos);
+	if (d == 0) {
+	    if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		break;
+	} else if (d < 0) {
+	    __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+	    return 0;
+	} else {
+	    pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	}
+    }
+    s->cmd = *c;
+    __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* for the single consumer. returns 0 when the ring is empty */
+static inline int ss_cmd_pop(struct ss_cmd_ring * r, struct ss_cmd * c) {
+    struct ss_cmd_slot * s = &r->ring[r->head & (SS_CMD_SLOTS - 1)];
+
+    if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != r->head + 1)
+	return 0;
+    *c = s->cmd;
+    __atomic_store_n(&s->seq, r->head + SS_CMD_SLOTS, __ATOMIC_RELEASE);
+    r->head++;
+    return 1;
+}
+
+static inline void ss_cmd_init(struct ss_cmd_ring * r) {
+    uint32_t i;
+    r->slots = SS_CMD_SLOTS;
+    r->version = SS_CMD_VERSION;
+    r->dropped = 0;
+    r->head = r->tail = 0;
+    for (i = 0; i < SS_CMD_SLOTS; i++) r->ring[i].seq = i;
+    __atomic_store_n(&r->magic, SS_CMD_MAGIC, __ATOMIC_RELEASE);
+}
+
+/* maps a ring created by soundspace, NULL if there is none (yet) */
+static inline struct ss_cmd_ring * ss_cmd_open(const char * name) {
+    struct ss_cmd_ring * r;
+    int fd = shm_open(name, O_RDWR, 0);
+
+    if (fd < 0) return NULL;
+    r = (struct ss_cmd_ring *)mmap(NULL, sizeof(*r), PROT_READ | PROT_WRITE,
+				   MAP_SHARED, fd, 0);
+    close(fd);
+    if (r == MAP_FAILED) return NULL;
+    if (__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != SS_CMD_MAGIC
+	|| r->version != SS_CMD_VERSION) {
+	munmap(r, sizeof(*r));
+	return NULL;
+    }
+    return r;
+}
+
+static inline void ss_cmd_close(struct ss_cmd_ring * r) {
+    munmap(r, sizeof(*r));
+}
+
+/*
+ * The state table, a read-only view of soundspace for monitors. It is
+ * created under the name given as "shm_state" and rewritten every
+ * "shm_tick_ms". Read it with ss_state_read(), which retries while
+ * soundspace is writing, so monitors never block soundspace.
+ *
+ *   size_t size;
+ *   struct ss_state * st = ss_state_open("/soundspace-state", &size);
+ *   struct ss_state * copy = malloc(size);
+ *   ss_state_read(st, copy, size);
+ */
+
+#define SS_STATE_MAGIC		0x53535331	/* "SSS1" */
+#define SS_STATE_VERSION	1
+#define SS_STATE_NAME_LEN	64
+
+enum ss_play_state {
+    SS_INITIAL = 0,
+    SS_PLAYING,
+    SS_PAUSED,
+    SS_STOPPED
+};
+
+/* run time of a code path, in microseconds */
+struct ss_timing {
+    uint64_t count;
+    double last;
+    double max;
+    double total;
+};
+
+struct ss_source_state {
+    char name[SS_STATE_NAME_LEN];	/* cut off, always terminated */
+    float position[3];
+    float gain;
+    float pitch;
+    uint32_t state;			/* enum ss_play_state */
+    uint32_t underruns;
+    uint32_t pad;
+    double offset;			/* seconds into the file */
+};
+
+struct ss_state {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;			/* odd while soundspace writes */
+    uint32_t max_sources;
+    uint32_t nsources;			/* may be more than max_sources */
+    uint32_t pad;
+    uint64_t ticks;
+    double time;			/* CLOCK_MONOTONIC seconds */
+    struct ss_timing animator;		/* animation steps */
+    struct ss_timing refill;		/* refilling stream queues */
+    uint64_t underruns;
+    struct ss_source_state sources[];	/* max_sources of them */
+};
+
+static inline size_t ss_state_size(uint32_t max_sources) {
+    return sizeof(struct ss_state)
+	   + max_sources * sizeof(struct ss_source_state);
+}
+
+static inline void ss_state_begin(struct ss_state * st) {
+    __atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void ss_state_end(struct ss_state * st) {
+    __atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* copies a consistent snapshot of at most size bytes */
+static inline void ss_state_read(const struct ss_state * st, void * copy,
+				 size_t size) {
+    uint32_t s1, s2;
+    do {
+	s1 = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE);
+	if (s1 & 1) continue;
+	__builtin_memcpy(copy, (const void *)st, size);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	s2 = __atomic_load_n(&st->seq, __ATOMIC_RELAXED);
+	if (s1 == s2) return;
+    } while (1);
+}
+
+/* maps the table read-only, NULL if there is none (yet) */
+static inline struct ss_state * ss_state_open(const char * name,
+					      size_t * size) {
+    struct ss_state * st;
+    struct stat sb;
+    int fd = shm_open(name, O_RDONLY, 0);
+
+    if (fd < 0) return NULL;
+    if (fstat(fd, &sb) || (size_t)sb.st_size < sizeof(*st)) {
+	close(fd);
+	return NULL;
+    }
+    st = (struct ss_state *)mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED,
+				 fd, 0);
+    close(fd);
+    if (st == MAP_FAILED) return NULL;
+    if (__atomic_load_n(&st->magic, __ATOMIC_ACQUIRE) != SS_STATE_MAGIC
+	|| st->version != SS_STATE_VERSION) {
+	munmap(st, sb.st_size);
+	return NULL;
+    }
+    *size = sb.st_size;
+    return st;
+}
+
+#endif